@@ -0,0 +1,243 @@
+/* cache_dev= mode: the disk is a write-back cache in front of a slower
+ * block device. It is the image= machinery over that device, pages being
+ * read in on first access, with a dirty bit per page: writes and
+ * discards are absorbed in RAM and set it, and a worker writes the dirty
+ * pages back cache_flush_ms after the first of them, in ascending order,
+ * runs of consecutive pages merged into one write. REQ_PREFLUSH writes
+ * back everything and flushes the lower device, REQ_FUA the pages written.
+ * With tier_ram_mb, clean pages are dropped without a write.
+ *
+ * A writer sets the dirty bit after updating the store, the write-back
+ * clears it before copying the page, so a write it misses is left dirty.
+ * Pages are copied under their image lock and keep a cache_wb bit until
+ * the lower device has them, so that demotion does not drop them early. */
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/file.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/bitops.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/workqueue.h>
+#include <linux/sched.h>
+#include <linux/printk.h>
+
+#include "IO_driver.h"
+
+/* Most pages merged into one write to the lower device */
+#define RB_CACHE_BATCH 64
+
+static unsigned long rb_cache_pages(struct rb_device *rb_dev){
+    return DIV_ROUND_UP(rb_dev->size, PAGE_SECTORS);
+}
+
+/* Take page idx for a write-back into dst if it is dirty; it stays
+ * under write-back until rb_cache_written() */
+static bool rb_cache_grab(struct rb_device *rb_dev, unsigned long idx, void *dst){
+    struct mutex *lock = rb_image_lock(rb_dev, idx);
+    bool dirty;
+    mutex_lock(lock);
+    dirty = test_and_clear_bit(idx, rb_dev->cache_dirty);
+    if(dirty){
+        set_bit(idx, rb_dev->cache_wb);
+        atomic_long_dec(&rb_dev->cache_dirty_pages);
+        rb_store_peek_page(rb_dev, idx, dst);
+    }
+    mutex_unlock(lock);
+    return dirty;
+}
+
+/* End the write-back of nr pages from idx, dirty again if it failed */
+static void rb_cache_written(struct rb_device *rb_dev, unsigned long idx, unsigned int nr, bool done){
+    unsigned int i;
+    for(i = 0; i < nr; ++i){
+        if(!done)
+            rb_cache_dirty(rb_dev, idx + i);
+        clear_bit(idx + i, rb_dev->cache_wb);
+    }
+}
+
+/* Write back the dirty pages of [first, last], one write per run of
+ * consecutive pages; cache_flush_lock is held */
+static int rb_cache_writeback(struct rb_device *rb_dev, unsigned long first, unsigned long last){
+    unsigned long idx = first;
+    unsigned int nr;
+    ssize_t done;
+    loff_t pos;
+    while((idx = find_next_bit(rb_dev->cache_dirty, last + 1, idx)) <= last){
+        nr = 0;
+        while(nr < RB_CACHE_BATCH && idx + nr <= last && rb_cache_grab(rb_dev, idx + nr, rb_dev->cache_buf + nr * PAGE_SIZE))
+            nr++;
+        /* written back by a demotion since find_next_bit() saw it */
+        if(!nr){
+            idx++;
+            continue;
+        }
+        pos = (loff_t)idx << PAGE_SHIFT;
+        done = kernel_write(rb_dev->image, rb_dev->cache_buf, nr * PAGE_SIZE, &pos);
+        rb_cache_written(rb_dev, idx, nr, done == nr * PAGE_SIZE);
+        if(done != nr * PAGE_SIZE)
+            return done < 0 ? done : -EIO;
+        this_cpu_add(rb_dev->stats->cache_written, nr);
+        this_cpu_inc(rb_dev->stats->cache_batches);
+        idx += nr;
+        cond_resched();
+    }
+    return 0;
+}
+
+static void rb_cache_work(struct work_struct *work){
+    struct rb_device *rb_dev = container_of(to_delayed_work(work), struct rb_device, cache_work);
+    int err;
+    mutex_lock(&rb_dev->cache_flush_lock);
+    err = rb_cache_writeback(rb_dev, 0, rb_cache_pages(rb_dev) - 1);
+    mutex_unlock(&rb_dev->cache_flush_lock);
+    if(err)
+        printk_ratelimited(KERN_ERR "Device %d: writing back to %pD failed: %d\n",rb_dev->index, rb_dev->image, err);
+}
+
+/* Write back pages [first, last] and make them durable on the lower device */
+static int rb_cache_sync(struct rb_device *rb_dev, unsigned long first, unsigned long last){
+    int err;
+    mutex_lock(&rb_dev->cache_flush_lock);
+    err = rb_cache_writeback(rb_dev, first, last);
+    mutex_unlock(&rb_dev->cache_flush_lock);
+    if(err)
+        return err;
+    this_cpu_inc(rb_dev->stats->cache_syncs);
+    return vfs_fsync_range(rb_dev->image, (loff_t)first << PAGE_SHIFT, ((loff_t)(last + 1) << PAGE_SHIFT) - 1, 1);
+}
+
+static void rb_cache_release(struct rb_device *rb_dev){
+    kvfree(rb_dev->cache_buf);
+    kvfree(rb_dev->cache_wb);
+    kvfree(rb_dev->cache_dirty);
+    rb_dev->cache_buf = NULL;
+    rb_dev->cache_wb = NULL;
+    rb_dev->cache_dirty = NULL;
+    rb_image_close(rb_dev, false);
+}
+
+/* Open the block device at path and cache it, the disk taking its size
+ * rounded down to a page; dirty pages are written back flush_ms after
+ * the first of them */
+int rb_cache_open(struct rb_device *rb_dev, const char *path, unsigned int flush_ms){
+    unsigned long nr_pages;
+    struct file *file;
+    loff_t size;
+    bool bdev;
+    int status;
+    file = filp_open(path, O_RDONLY | O_LARGEFILE, 0);
+    if(IS_ERR(file)){
+        printk(KERN_ERR "Unable to open cache device %s\n",path);
+        return PTR_ERR(file);
+    }
+    bdev = S_ISBLK(file_inode(file)->i_mode);
+    size = i_size_read(file->f_mapping->host);
+    filp_close(file, NULL);
+    if(!bdev || size < PAGE_SIZE){
+        printk(KERN_ERR "Cache device %s is not a block device of a page or more\n",path);
+        return -EINVAL;
+    }
+    rb_dev->size = (sector_t)(size >> PAGE_SHIFT) << PAGE_SECTORS_SHIFT;
+    status = rb_image_open(rb_dev, path);
+    if(status)
+        return status;
+    nr_pages = rb_cache_pages(rb_dev);
+    rb_dev->cache_dirty = kvcalloc(BITS_TO_LONGS(nr_pages), sizeof(unsigned long), GFP_KERNEL);
+    rb_dev->cache_wb = kvcalloc(BITS_TO_LONGS(nr_pages), sizeof(unsigned long), GFP_KERNEL);
+    rb_dev->cache_buf = kvmalloc(RB_CACHE_BATCH * PAGE_SIZE, GFP_KERNEL);
+    if(!rb_dev->cache_dirty || !rb_dev->cache_wb || !rb_dev->cache_buf){
+        rb_cache_release(rb_dev);
+        return -ENOMEM;
+    }
+    atomic_long_set(&rb_dev->cache_dirty_pages, 0);
+    INIT_DELAYED_WORK(&rb_dev->cache_work, rb_cache_work);
+    mutex_init(&rb_dev->cache_flush_lock);
+    rb_dev->cache_delay = msecs_to_jiffies(flush_ms);
+    printk(KERN_INFO "Device %d: write-back cache of %s, %llu bytes\n",rb_dev->index, path, (unsigned long long)rb_dev->size << SECTOR_SHIFT);
+    return 0;
+}
+
+/* Write back what is dirty with save set, then let the device go; the
+ * image is closed here, without the image= save */
+void rb_cache_close(struct rb_device *rb_dev, bool save){
+    int err;
+    if(!rb_dev->cache_dirty)
+        return;
+    if(save){
+        err = rb_cache_sync(rb_dev, 0, rb_cache_pages(rb_dev) - 1);
+        if(err)
+            printk(KERN_ERR "Writing back to %pD failed: %d\n",rb_dev->image, err);
+    }
+    /* after the last write-back, which may have queued it again */
+    cancel_delayed_work_sync(&rb_dev->cache_work);
+    rb_cache_release(rb_dev);
+}
+
+/* Page idx now differs from the lower device, the store holding its new
+ * content: written, or zeroed by a discard */
+void rb_cache_dirty(struct rb_device *rb_dev, unsigned long idx){
+    if(!rb_dev->cache_dirty)
+        return;
+    /* the store's update before the bit: the bit may be set already and
+     * test_and_set_bit() then orders nothing */
+    smp_mb();
+    if(test_and_set_bit(idx, rb_dev->cache_dirty))
+        return;
+    atomic_long_inc(&rb_dev->cache_dirty_pages);
+    queue_delayed_work(system_unbound_wq, &rb_dev->cache_work, rb_dev->cache_delay);
+}
+
+/* Every page of sectors [start, end) */
+void rb_cache_dirty_range(struct rb_device *rb_dev, sector_t start, sector_t end){
+    unsigned long idx;
+    if(!rb_dev->cache_dirty || start >= end)
+        return;
+    for(idx = start >> PAGE_SECTORS_SHIFT; idx <= (end - 1) >> PAGE_SECTORS_SHIFT; ++idx)
+        rb_cache_dirty(rb_dev, idx);
+}
+
+/* Count an access to page idx: a hit unless it has to be read in from
+ * the lower device; with load false the page is overwritten whole */
+void rb_cache_access(struct rb_device *rb_dev, unsigned long idx, bool load){
+    if(!rb_dev->cache_dirty)
+        return;
+    if(!load || test_bit(idx, rb_dev->image_loaded))
+        this_cpu_inc(rb_dev->stats->cache_hits);
+    else
+        this_cpu_inc(rb_dev->stats->cache_misses);
+}
+
+/* Demotion of page idx, image lock held. Busy: it is being written back
+ * and the lower device does not have it yet. Clean: the lower device has
+ * it, and a dirty page's bit is taken; the caller writes it out, or gives
+ * the bit back with rb_cache_dirty() if it cannot. Without a cache every
+ * page has to be written. */
+bool rb_cache_busy(struct rb_device *rb_dev, unsigned long idx){
+    return rb_dev->cache_wb && test_bit(idx, rb_dev->cache_wb);
+}
+
+bool rb_cache_clean(struct rb_device *rb_dev, unsigned long idx){
+    if(!rb_dev->cache_dirty)
+        return false;
+    if(!test_and_clear_bit(idx, rb_dev->cache_dirty))
+        return true;
+    atomic_long_dec(&rb_dev->cache_dirty_pages);
+    return false;
+}
+
+/* REQ_PREFLUSH: everything written so far is durable on return */
+int rb_cache_flush(struct rb_device *rb_dev){
+    if(!rb_dev->cache_dirty)
+        return 0;
+    return rb_cache_sync(rb_dev, 0, rb_cache_pages(rb_dev) - 1);
+}
+
+/* REQ_FUA: the nr_sects written at sector are durable on return */
+int rb_cache_fua(struct rb_device *rb_dev, sector_t sector, sector_t nr_sects){
+    if(!rb_dev->cache_dirty || !nr_sects)
+        return 0;
+    return rb_cache_sync(rb_dev, sector >> PAGE_SECTORS_SHIFT, (sector + nr_sects - 1) >> PAGE_SECTORS_SHIFT);
+}
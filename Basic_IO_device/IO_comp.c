@@ -0,0 +1,329 @@
+/* Compressed backing store: every page written is run through an acomp
+ * compressor, synchronous implementations only, and kept as a struct rb_obj, or as a bare page when it does
+ * not shrink enough to be worth it. Same-filled pages skip both. A page
+ * is rewritten as a whole, so its slot lock covers the read-modify-write
+ * and keeps readers away from an object being freed. */
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/gfp.h>
+#include <linux/highmem.h>
+#include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/local_lock.h>
+#include <linux/cpuhotplug.h>
+#include <linux/scatterlist.h>
+#include <crypto/acompress.h>
+#include <linux/printk.h>
+#include <linux/xarray.h>
+
+#include "IO_driver.h"
+
+#define RB_COMP_BUF_SIZE (2 * PAGE_SIZE)    /* some compressors expand */
+#define RB_COMP_MAX (PAGE_SIZE / 4 * 3)     /* above this, keep the page */
+
+/* Per-CPU compression stream */
+struct rb_strm {
+    local_lock_t lock;
+    struct crypto_acomp *tfm;
+    struct acomp_req *req;
+    u8 *work;                       /* Page being rebuilt by a partial write */
+    u8 *out;                        /* Compressor output */
+};
+
+static const char *rb_comp_algo;
+static struct rb_strm __percpu *rb_strms;
+static int rb_comp_hp;              /* dynamic cpuhp state */
+
+static int rb_comp_cpu_dead(unsigned int cpu){
+    struct rb_strm *strm = per_cpu_ptr(rb_strms, cpu);
+    if(strm->req)
+        acomp_request_free(strm->req);
+    if(strm->tfm)
+        crypto_free_acomp(strm->tfm);
+    kfree(strm->work);
+    kfree(strm->out);
+    strm->tfm = NULL;
+    strm->req = NULL;
+    strm->work = NULL;
+    strm->out = NULL;
+    return 0;
+}
+
+static int rb_comp_cpu_prepare(unsigned int cpu){
+    struct rb_strm *strm = per_cpu_ptr(rb_strms, cpu);
+    struct crypto_acomp *tfm;
+    /* the mask keeps out asynchronous ones: streams are used under locks */
+    tfm = crypto_alloc_acomp(rb_comp_algo, 0, CRYPTO_ALG_ASYNC);
+    if(IS_ERR(tfm))
+        return PTR_ERR(tfm);
+    strm->tfm = tfm;
+    strm->req = acomp_request_alloc(tfm);
+    if(strm->req)
+        acomp_request_set_callback(strm->req, 0, NULL, NULL);
+    strm->work = kmalloc_node(PAGE_SIZE, GFP_KERNEL, cpu_to_node(cpu));
+    strm->out = kmalloc_node(RB_COMP_BUF_SIZE, GFP_KERNEL, cpu_to_node(cpu));
+    if(!strm->req || !strm->work || !strm->out){
+        rb_comp_cpu_dead(cpu);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+/* Streams are shared by every device, one per online CPU */
+int rb_comp_init(const char *algo){
+    int cpu, status;
+    if(!crypto_has_acomp(algo, 0, CRYPTO_ALG_ASYNC)){
+        printk(KERN_ERR "Compression algorithm %s is not available\n",algo);
+        return -ENOENT;
+    }
+    rb_comp_algo = algo;
+    rb_strms = alloc_percpu(struct rb_strm);
+    if(!rb_strms)
+        return -ENOMEM;
+    for_each_possible_cpu(cpu)
+        local_lock_init(&per_cpu_ptr(rb_strms, cpu)->lock);
+    status = cpuhp_setup_state(CPUHP_BP_PREPARE_DYN, "block/ramdisk:comp", rb_comp_cpu_prepare, rb_comp_cpu_dead);
+    if(status < 0){
+        free_percpu(rb_strms);
+        rb_strms = NULL;
+        return status;
+    }
+    rb_comp_hp = status;
+    return 0;
+}
+
+void rb_comp_exit(void){
+    if(!rb_strms)
+        return;
+    cpuhp_remove_state(rb_comp_hp);
+    free_percpu(rb_strms);
+    rb_strms = NULL;
+}
+
+static struct rb_strm *rb_strm_get(void){
+    local_lock(&rb_strms->lock);
+    return this_cpu_ptr(rb_strms);
+}
+
+static void rb_strm_put(void){
+    local_unlock(&rb_strms->lock);
+}
+
+/* Add (sign 1) or remove (sign -1) an entry from the footprint counters */
+static void rb_comp_account(struct rb_device *rb_dev, void *entry, int sign){
+    struct rb_comp_stats *cs = &rb_dev->comp_stats;
+    if(!entry)
+        return;
+    if(rb_entry_is_fill(entry)){
+        atomic_long_add(sign, &rb_dev->same_pages);
+        return;
+    }
+    if(!rb_entry_is_obj(entry)){
+        atomic_long_add(sign, &cs->huge);
+        return;
+    }
+    atomic_long_add(sign, &cs->pages);
+    atomic_long_add(sign * (long)rb_entry_obj(entry)->len, &cs->bytes);
+}
+
+/* Run slen bytes of src through the stream into dst, *dlen bytes at
+ * most; both have to be in the linear map for the scatterlists */
+static int rb_acomp_run(struct rb_strm *strm, bool comp, const void *src, unsigned int slen, void *dst, unsigned int *dlen){
+    struct scatterlist sg_src, sg_dst;
+    int err;
+    sg_init_one(&sg_src, src, slen);
+    sg_init_one(&sg_dst, dst, *dlen);
+    acomp_request_set_params(strm->req, &sg_src, &sg_dst, slen, *dlen);
+    err = comp ? crypto_acomp_compress(strm->req) : crypto_acomp_decompress(strm->req);
+    *dlen = strm->req->dlen;
+    return err;
+}
+
+static int rb_decompress(struct rb_strm *strm, struct rb_obj *obj, void *dst){
+    unsigned int dlen = PAGE_SIZE;
+    void *out = virt_addr_valid(dst) ? dst : strm->work;
+    if(rb_acomp_run(strm, false, obj->data, obj->len, out, &dlen) || dlen != PAGE_SIZE)
+        return -EIO;
+    if(out != dst)
+        memcpy(dst, out, PAGE_SIZE);
+    return 0;
+}
+
+/* Expand any entry into a full page at buf */
+static int rb_decode(struct rb_strm *strm, void *entry, void *buf){
+    if(!entry){
+        memset(buf, 0, PAGE_SIZE);
+        return 0;
+    }
+    if(rb_entry_is_fill(entry)){
+        rb_fill_buf(buf, rb_entry_fill(entry), PAGE_SIZE);
+        return 0;
+    }
+    if(!rb_entry_is_obj(entry)){
+        memcpy_from_page(buf, entry, 0, PAGE_SIZE);
+        return 0;
+    }
+    return rb_decompress(strm, rb_entry_obj(entry), buf);
+}
+
+/* Write len bytes of src (zeroes if NULL) at offset in page idx. Under
+ * the locks only atomic allocations are tried; when one fails and gfp
+ * may sleep, the memory is taken outside and the page redone. */
+int rb_comp_write(struct rb_device *rb_dev, unsigned long idx, const void *src, unsigned int offset, unsigned int len, gfp_t gfp){
+    spinlock_t *lock = rb_slot_lock(rb_dev, idx);
+    int node = rb_store_node(rb_dev, idx);
+    struct page *page, *spare_page = NULL;
+    struct rb_obj *obj, *spare = NULL;
+    struct rb_strm *strm;
+    void *old, *new, *cur;
+    const void *in;
+    unsigned long word;
+    unsigned int dlen;
+    bool huge, reserved = false;
+    int err = 0;
+    /* grow the xarray now, storing under the lock must not allocate */
+    if(!xa_load(rb_dev->pages, idx)){
+        err = xa_reserve(rb_dev->pages, idx, gfp);
+        if(err)
+            return err;
+        reserved = true;
+    }
+retry:
+    spin_lock(lock);
+    strm = rb_strm_get();
+    old = xa_load(rb_dev->pages, idx);
+    if(src && len == PAGE_SIZE && virt_addr_valid(src)){
+        in = src;
+    }else if(src && len == PAGE_SIZE){
+        /* not in the linear map: no scatterlist for it */
+        memcpy(strm->work, src, PAGE_SIZE);
+        in = strm->work;
+    }else{
+        /* rebuild the page around the new bytes */
+        if(len < PAGE_SIZE){
+            /* absent from the top: start from the layers below */
+            err = rb_decode(strm, old ? old : rb_base_load(rb_dev, idx), strm->work);
+            if(err){
+                atomic_long_inc(&rb_dev->comp_stats.failed);
+                goto out_unlock;
+            }
+        }
+        if(src)
+            memcpy(strm->work + offset, src, len);
+        else
+            memset(strm->work + offset, 0, len);
+        in = strm->work;
+    }
+    if(rb_same_filled(in, &word)){
+        /* nothing to compress nor to allocate */
+        new = rb_mk_fill(word);
+        goto store;
+    }
+    dlen = RB_COMP_BUF_SIZE;
+    huge = rb_acomp_run(strm, true, in, PAGE_SIZE, strm->out, &dlen) || dlen > RB_COMP_MAX;
+    if(huge){
+        page = spare_page;
+        if(!page)
+            page = alloc_pages_node(node, GFP_NOWAIT | __GFP_NOWARN | __GFP_HIGHMEM, 0);
+        if(!page)
+            goto out_alloc;
+        spare_page = NULL;
+        memcpy_to_page(page, 0, in, PAGE_SIZE);
+        new = page;
+    }else{
+        obj = spare;
+        if(!obj || ksize(obj) < struct_size(obj, data, dlen))
+            obj = kmalloc_node(struct_size(obj, data, dlen), GFP_NOWAIT | __GFP_NOWARN, node);
+        if(!obj)
+            goto out_alloc;
+        if(obj == spare)
+            spare = NULL;
+        obj->len = dlen;
+        memcpy(obj->data, strm->out, dlen);
+        new = xa_tag_pointer(obj, RB_ENTRY_OBJ);
+    }
+store:
+    rb_strm_put();
+    cur = xa_store(rb_dev->pages, idx, new, GFP_NOWAIT | __GFP_NOWARN);
+    spin_unlock(lock);
+    if(xa_is_err(cur)){
+        rb_entry_free(new);
+        err = xa_err(cur);
+        goto out;
+    }
+    rb_comp_account(rb_dev, new, 1);
+    rb_comp_account(rb_dev, old, -1);
+    rb_entry_free(old);
+    goto out;
+out_alloc:
+    rb_strm_put();
+    spin_unlock(lock);
+    err = -ENOMEM;
+    if(!gfpflags_allow_blocking(gfp))
+        goto out;
+    if(huge){
+        spare_page = alloc_pages_node(node, gfp | __GFP_HIGHMEM, 0);
+        if(!spare_page)
+            goto out;
+    }else{
+        kfree(spare);
+        spare = kmalloc_node(struct_size(spare, data, dlen), gfp, node);
+        if(!spare)
+            goto out;
+    }
+    err = 0;
+    goto retry;
+out_unlock:
+    rb_strm_put();
+    spin_unlock(lock);
+out:
+    /* a failed write gives back the slot it reserved, if still empty */
+    if(err && reserved)
+        xa_release(rb_dev->pages, idx);
+    kfree(spare);
+    if(spare_page)
+        __free_page(spare_page);
+    return err;
+}
+
+int rb_comp_read(struct rb_device *rb_dev, unsigned long idx, void *dst, unsigned int offset, unsigned int len){
+    spinlock_t *lock = rb_slot_lock(rb_dev, idx);
+    struct rb_strm *strm;
+    void *entry;
+    int err = 0;
+    spin_lock(lock);
+    entry = xa_load(rb_dev->pages, idx);
+    if(!entry)
+        entry = rb_base_load(rb_dev, idx);
+    if(!entry){
+        memset(dst, 0, len);
+    }else if(rb_entry_is_fill(entry)){
+        rb_fill_buf(dst, rb_entry_fill(entry), len);
+    }else if(!rb_entry_is_obj(entry)){
+        memcpy_from_page(dst, entry, offset, len);
+    }else{
+        strm = rb_strm_get();
+        if(len == PAGE_SIZE){
+            err = rb_decompress(strm, rb_entry_obj(entry), dst);
+        }else{
+            err = rb_decompress(strm, rb_entry_obj(entry), strm->work);
+            if(!err)
+                memcpy(dst, strm->work + offset, len);
+        }
+        rb_strm_put();
+    }
+    spin_unlock(lock);
+    if(err)
+        atomic_long_inc(&rb_dev->comp_stats.failed);
+    return err;
+}
+
+void rb_comp_erase(struct rb_device *rb_dev, unsigned long idx){
+    spinlock_t *lock = rb_slot_lock(rb_dev, idx);
+    void *entry;
+    spin_lock(lock);
+    entry = xa_erase(rb_dev->pages, idx);
+    spin_unlock(lock);
+    rb_comp_account(rb_dev, entry, -1);
+    rb_entry_free(entry);
+}
@@ -0,0 +1,118 @@
+/* Copies of bulk transfers with non-temporal stores, so that streaming
+ * through the ramdisk does not push everyone else's data out of the
+ * caches. The kind of copy is picked once from the CPU's features: AVX
+ * streaming stores under kernel_fpu_begin(), else movnti from general
+ * registers, else plain memcpy. Streaming stores are weakly ordered, so
+ * each copy ends with an sfence before its data can be published. */
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/highmem.h>
+#include <linux/printk.h>
+#ifdef CONFIG_X86_64
+#include <asm/cpufeature.h>
+#include <asm/fpu/api.h>
+#endif
+
+#include "IO_driver.h"
+
+enum {
+    RB_COPY_PLAIN,
+    RB_COPY_MOVNTI,
+    RB_COPY_AVX,
+};
+
+static const char * const rb_copy_names[] = {
+    [RB_COPY_PLAIN] = "memcpy",
+    [RB_COPY_MOVNTI] = "movnti",
+    [RB_COPY_AVX] = "avx",
+};
+
+static int rb_copy_kind = RB_COPY_PLAIN;
+
+void rb_copy_init(void){
+#ifdef CONFIG_X86_64
+    /* SSE2, and movnti with it, is part of x86-64 */
+    rb_copy_kind = RB_COPY_MOVNTI;
+    if(boot_cpu_has(X86_FEATURE_AVX) && cpu_has_xfeatures(XFEATURE_MASK_SSE | XFEATURE_MASK_YMM, NULL))
+        rb_copy_kind = RB_COPY_AVX;
+#endif
+    printk(KERN_INFO "Streaming copies use %s\n",rb_copy_names[rb_copy_kind]);
+}
+
+const char *rb_copy_name(void){
+    return rb_copy_names[rb_copy_kind];
+}
+
+#ifdef CONFIG_X86_64
+#define RB_AVX_MIN 1024     /* below, the FPU state switch costs more than it saves */
+#define RB_AVX_CHUNK 4096   /* most bytes copied with preemption off */
+
+static void rb_copy_movnti(void *dst, const void *src, size_t len){
+    size_t head = min_t(size_t, len, -(unsigned long)dst & 7);
+    u64 v;
+    memcpy(dst, src, head);
+    dst += head;
+    src += head;
+    len -= head;
+    for(; len >= 8; len -= 8, dst += 8, src += 8){
+        memcpy(&v, src, 8);
+        asm volatile("movnti %1, %0" : "=m" (*(u64 *)dst) : "r" (v));
+    }
+    memcpy(dst, src, len);
+}
+
+/* len is at least RB_AVX_MIN, and the FPU usable. kernel_fpu_begin()
+ * disables preemption, so a large copy takes it a chunk at a time. */
+static void rb_copy_avx(void *dst, const void *src, size_t len){
+    size_t head = -(unsigned long)dst & 31, end;
+    memcpy(dst, src, head);
+    dst += head;
+    src += head;
+    len -= head;
+    while(len >= 128){
+        end = len - min_t(size_t, round_down(len, 128), RB_AVX_CHUNK);
+        kernel_fpu_begin();
+        for(; len > end; len -= 128, dst += 128, src += 128){
+            asm volatile("vmovdqu 0(%1), %%ymm0\n\t"
+                         "vmovdqu 32(%1), %%ymm1\n\t"
+                         "vmovdqu 64(%1), %%ymm2\n\t"
+                         "vmovdqu 96(%1), %%ymm3\n\t"
+                         "vmovntdq %%ymm0, 0(%0)\n\t"
+                         "vmovntdq %%ymm1, 32(%0)\n\t"
+                         "vmovntdq %%ymm2, 64(%0)\n\t"
+                         "vmovntdq %%ymm3, 96(%0)"
+                         : : "r" (dst), "r" (src) : "memory");
+        }
+        kernel_fpu_end();
+    }
+    rb_copy_movnti(dst, src, len);
+}
+#endif
+
+/* Copy len bytes, with streaming stores if stream is set */
+void rb_copy(void *dst, const void *src, size_t len, bool stream){
+    if(!stream || rb_copy_kind == RB_COPY_PLAIN){
+        memcpy(dst, src, len);
+        return;
+    }
+#ifdef CONFIG_X86_64
+    if(rb_copy_kind == RB_COPY_AVX && len >= RB_AVX_MIN && irq_fpu_usable())
+        rb_copy_avx(dst, src, len);
+    else
+        rb_copy_movnti(dst, src, len);
+    wmb();
+#endif
+}
+
+void rb_copy_to_page(struct page *page, unsigned int offset, const void *src, unsigned int len, bool stream){
+    void *addr = kmap_local_page(page);
+    rb_copy(addr + offset, src, len, stream);
+    flush_dcache_page(page);
+    kunmap_local(addr);
+}
+
+void rb_copy_from_page(void *dst, struct page *page, unsigned int offset, unsigned int len, bool stream){
+    void *addr = kmap_local_page(page);
+    rb_copy(dst, addr + offset, len, stream);
+    kunmap_local(addr);
+}
@@ -1,5 +1,5 @@
 /* Includes */
-// maybe clean up some of them? 
+// maybe clean up some of them?
 #include <linux/init.h>
 #include <linux/module.h>
 #include <linux/moduleparam.h>
@@ -7,15 +7,27 @@
 
 #include <linux/kdev_t.h>
 #include <linux/fs.h>
-#include <asm/uaccess.h>
+#include <linux/hdreg.h>
+#include <linux/uaccess.h>
 #include <linux/mutex.h>
 #include <linux/device.h>
 #include <linux/list.h>
 #include <linux/slab.h>
+#include <linux/highmem.h>
+#include <linux/ktime.h>
+#include <linux/percpu.h>
+#include <linux/printk.h>
+#include <linux/topology.h>
 #include <linux/blkdev.h>
 #include <linux/blk_types.h>
-#include <linux/genhd.h>
+#include <linux/blk-mq.h>
+#include <linux/idr.h>
+#include <linux/overflow.h>
+#include <linux/capability.h>
+#include <linux/t10-pi.h>
 
+#include "IO_driver.h"
+#include "IO_ioctl.h"
 
 #define LICENCE "GPL"
 #define AUTEUR "FE D"
@@ -23,166 +35,1111 @@
 #define DEVICE "my_block_device"
 
 #define DEF_MAJOR 0
-#define BLOCK_MINORS 1
 #define BLOCKNAME "my_block_device"
-#define SECSIZE 1024            /* page4, block size 4ko*/
-#define KERNEL_SECTOR_SIZE 512  /* page4, sector size 512o*/
-
-/* Peripheral's structure */
-static struct rb_device { 
-    unsigned int size;              /* Size of the device (in sectors) */ 
-    int major;
-    spinlock_t lock;                /* For exclusive access to our request queue */
-    u8 *data;                     
-    struct request_queue *rb_queue; /* Our request queue */ 
-    struct gendisk *rb_disk;        /* kernel's internal representation */ 
-}b_dev;
+
+/* queue_mode values */
+#define RB_Q_BIO 0              /* submit_bio, no request allocation */
+#define RB_Q_MQ 1               /* blk-mq hardware queues */
+
+static LIST_HEAD(rb_devices);       /* every disk, created at load or snapshots */
+static DEFINE_MUTEX(rb_devices_lock);   /* rb_devices once the disks are live */
+static DEFINE_IDA(rb_snap_ids);     /* indexes of snapshots, after the load's */
+static int rb_major;
 
 /* Block driver functions */
-static int rb_open(struct block_device *rb_dev, fmode_t mode);
-static void rb_release(struct gendisk *rb_disk, fmode_t mode);
-static int rb_getgeo(struct block_device *rb_dev, struct hd_geometry *geo);
-int rb_ioctl(struct block_device *rb_dev, fmode_t mode, uint cmd, unsigned long arg);
+static int rb_open(struct gendisk *rb_disk, blk_mode_t mode);
+static int rb_getgeo(struct block_device *bdev, struct hd_geometry *geo);
+int rb_ioctl(struct block_device *bdev, blk_mode_t mode, uint cmd, unsigned long arg);
+static int rb_snap_create(struct rb_device *origin, u32 __user *argp);
+static int rb_snap_delete(u32 __user *argp);
 
 static int create_gendisk(struct rb_device *rb_dev, int maj);
 static int init_queue(struct rb_device *rb_dev);
 static void delete_gendisk(struct rb_device *rb_dev);
+static struct rb_device *rb_alloc_device(int index, struct rb_layer *base);
+static void rb_free_device(struct rb_device *rb_dev);
 
-static void rb_request(struct request_queue *q);
-static int rb_transfer(struct request *req);
+static blk_status_t rb_queue_rq(struct blk_mq_hw_ctx *hctx, const struct blk_mq_queue_data *bd);
+static void rb_map_queues(struct blk_mq_tag_set *set);
+static int rb_poll(struct blk_mq_hw_ctx *hctx, struct io_comp_batch *iob);
+static int rb_init_hctx(struct blk_mq_hw_ctx *hctx, void *data, unsigned int hctx_idx);
+static int rb_init_request(struct blk_mq_tag_set *set, struct request *req, unsigned int hctx_idx, unsigned int numa_node);
+static void rb_submit_bio(struct bio *bio);
+static blk_status_t rb_check_io(struct rb_device *rb_dev, enum req_op op, sector_t beg, sector_t size);
+static int rb_do_nodata(struct rb_device *rb_dev, enum req_op op, blk_opf_t opf, sector_t beg, sector_t size, gfp_t gfp);
+static blk_status_t rb_transfer(struct request *req);
+static void rb_bio_error(struct bio *bio, int err);
+static bool rb_op_has_data(enum req_op op);
+static void rb_end_io(struct rb_device *rb_dev, enum req_op op, unsigned int bytes, unsigned int segs, u64 start);
 /* custom vars here */
 char *name="blk_dev";
 module_param(name, charp, S_IRUGO);
 
+static unsigned long size_kb = 512;
+module_param(size_kb, ulong, S_IRUGO);
+MODULE_PARM_DESC(size_kb, "Capacity of the device in KiB, backed lazily (default: 512)");
+
+static unsigned int nr_devices = 1;
+module_param(nr_devices, uint, S_IRUGO);
+MODULE_PARM_DESC(nr_devices, "Number of independent ramdisks to create (default: 1)");
+
+static unsigned int max_part;
+module_param(max_part, uint, S_IRUGO);
+MODULE_PARM_DESC(max_part, "Maximum number of partitions per device (default: 0, no partition table)");
+
+static int numa_policy = RB_NUMA_LOCAL;
+module_param(numa_policy, int, S_IRUGO);
+MODULE_PARM_DESC(numa_policy, "Backing page placement: 0=first-touch local, 1=home_node, 2=interleave (default: 0)");
+
+static int home_node = NUMA_NO_NODE;
+module_param(home_node, int, S_IRUGO);
+MODULE_PARM_DESC(home_node, "Home node with numa_policy=1 (default: spread devices over online nodes)");
+
+static int queue_mode = RB_Q_MQ;
+module_param(queue_mode, int, S_IRUGO);
+MODULE_PARM_DESC(queue_mode, "I/O path: 0=bio-based, 1=blk-mq (default: 1)");
+
+static unsigned int nr_hw_queues;
+module_param(nr_hw_queues, uint, S_IRUGO);
+MODULE_PARM_DESC(nr_hw_queues, "Number of hardware queues (default: one per CPU, or per node with queue_per_node)");
+
+static unsigned int queue_depth = 128;
+module_param(queue_depth, uint, S_IRUGO);
+MODULE_PARM_DESC(queue_depth, "Number of tags per hardware queue (default: 128)");
+
+static bool queue_per_node;
+module_param(queue_per_node, bool, S_IRUGO);
+MODULE_PARM_DESC(queue_per_node, "Map the CPUs of each NUMA node onto a shared hardware queue");
+
+static unsigned int poll_queues;
+module_param(poll_queues, uint, S_IRUGO);
+MODULE_PARM_DESC(poll_queues, "Number of extra hardware queues for polled (HIPRI/IOPOLL) I/O, blk-mq only (default: 0)");
+
+static unsigned int logical_block_size = KERNEL_SECTOR_SIZE;
+module_param(logical_block_size, uint, S_IRUGO);
+MODULE_PARM_DESC(logical_block_size, "Logical block size in bytes, 512 to PAGE_SIZE (default: 512)");
+
+static unsigned int physical_block_size;
+module_param(physical_block_size, uint, S_IRUGO);
+MODULE_PARM_DESC(physical_block_size, "Physical block size in bytes (default: logical_block_size)");
+
+static unsigned int max_sectors;
+module_param(max_sectors, uint, S_IRUGO);
+MODULE_PARM_DESC(max_sectors, "Largest request, in 512B sectors (default: 0, block layer default)");
+
+static unsigned int max_segments;
+module_param(max_segments, uint, S_IRUGO);
+MODULE_PARM_DESC(max_segments, "Most segments in a request (default: 0, block layer default)");
+
+static unsigned int max_segment_size;
+module_param(max_segment_size, uint, S_IRUGO);
+MODULE_PARM_DESC(max_segment_size, "Largest segment in bytes, at least PAGE_SIZE (default: 0, block layer default)");
+
+static char *comp_algo = "";
+module_param(comp_algo, charp, S_IRUGO);
+MODULE_PARM_DESC(comp_algo, "Compress backing pages with this crypto algorithm, e.g. lz4 or zstd (default: off)");
+
+static char *image = "";
+module_param(image, charp, S_IRUGO);
+MODULE_PARM_DESC(image, "File or block device the devices are saved to on unload and lazily restored from on load, suffixed .N with several devices (default: none)");
+
+static char *backing_file = "";
+module_param(backing_file, charp, S_IRUGO);
+MODULE_PARM_DESC(backing_file, "Regular file holding the device, read and written with async direct I/O, suffixed .N with several devices; queue_mode=1 only, without the page store options (default: none)");
+
+static char *cache_dev = "";
+module_param(cache_dev, charp, S_IRUGO);
+MODULE_PARM_DESC(cache_dev, "Block device the device caches, writes being written back later, its size replacing size_kb; one device, not with image, comp_algo, zoned, mmap_dev, par_threads, integrity nor backing_file (default: none)");
+
+static unsigned int cache_flush_ms = 1000;
+module_param(cache_flush_ms, uint, S_IRUGO);
+MODULE_PARM_DESC(cache_flush_ms, "Write dirty pages back to cache_dev this long after the first of them (default: 1000)");
+
+static bool zoned;
+module_param(zoned, bool, S_IRUGO);
+MODULE_PARM_DESC(zoned, "Host-managed zoned devices, blk-mq only");
+
+static unsigned long zone_size_kb = 64;
+module_param(zone_size_kb, ulong, S_IRUGO);
+MODULE_PARM_DESC(zone_size_kb, "Zone size in KiB with zoned=1, a power of 2 of at least PAGE_SIZE (default: 64)");
+
+static unsigned int zone_nr_conv;
+module_param(zone_nr_conv, uint, S_IRUGO);
+MODULE_PARM_DESC(zone_nr_conv, "Number of conventional zones at the start of a zoned device (default: 0)");
+
+static bool mmap_dev;
+module_param(mmap_dev, bool, S_IRUGO);
+MODULE_PARM_DESC(mmap_dev, "Add /dev/my_block_deviceN_mmap, mapping the backing pages; not with comp_algo or zoned");
+
+static bool huge_pages;
+module_param(huge_pages, bool, S_IRUGO);
+MODULE_PARM_DESC(huge_pages, "Back each new 2 MiB range with one huge folio, single pages if none is free; not with comp_algo, mmap_dev or tier_ram_mb");
+
+static unsigned int par_threads;
+module_param(par_threads, uint, S_IRUGO);
+MODULE_PARM_DESC(par_threads, "Copy large requests as up to this many chunks on other CPUs, blk-mq only, not with zoned (default: 0, off)");
+
+static unsigned int par_copy_kb = 1024;
+module_param(par_copy_kb, uint, S_IRUGO);
+MODULE_PARM_DESC(par_copy_kb, "Smallest request copied in chunks with par_threads, also in sysfs (default: 1024)");
+
+static unsigned int nt_copy_kb;
+module_param(nt_copy_kb, uint, S_IRUGO);
+MODULE_PARM_DESC(nt_copy_kb, "Copy transfers of at least this many KiB with non-temporal stores, also in sysfs (default: 0, off)");
+
+static unsigned long tier_ram_mb;
+module_param(tier_ram_mb, ulong, S_IRUGO);
+MODULE_PARM_DESC(tier_ram_mb, "RAM budget per device in MiB, colder pages being demoted to the image; needs image or cache_dev, not with comp_algo, zoned or mmap_dev (default: 0, no limit)");
+
+static int integrity = RB_INTEG_OFF;
+module_param(integrity, int, S_IRUGO);
+MODULE_PARM_DESC(integrity, "1: crc32c of each logical block, checked on reads and by scrubs, 2: also a T10-PI profile (queue_mode=1); not with image or mmap_dev (default: 0, off)");
+
 /* standard file_ops for block driver */
-static struct block_device_operations rb_fops = {
+static const struct block_device_operations rb_fops = {
     .owner = THIS_MODULE,
     .open = rb_open,
-    .release = rb_release,
-    .getgeo = rb_getgeo, 
+    .getgeo = rb_getgeo,
+    .ioctl = rb_ioctl,
+    .report_zones = rb_report_zones
+};
+
+/* same operations, with bios handed to us before any request exists */
+static const struct block_device_operations rb_bio_fops = {
+    .owner = THIS_MODULE,
+    .submit_bio = rb_submit_bio,
+    .open = rb_open,
+    .getgeo = rb_getgeo,
     .ioctl = rb_ioctl
 };
 
-static int rb_open(struct block_device *rb_dev, fmode_t modes){
-    /* TODO */
+/* blk-mq entry points, one context per CPU (or node) */
+static const struct blk_mq_ops rb_mq_ops = {
+    .queue_rq = rb_queue_rq,
+    .map_queues = rb_map_queues,
+    .poll = rb_poll,
+    .complete = rb_file_complete,
+    .init_hctx = rb_init_hctx,
+    .init_request = rb_init_request,
+};
+
+/* A snapshot being deleted cannot be opened again; open_mutex is held */
+static int rb_open(struct gendisk *rb_disk, blk_mode_t mode){
+    struct rb_device *rb_dev = rb_disk->private_data;
+    return rb_dev->dying ? -ENXIO : 0;
+}
+
+/* Made-up CHS geometry for fdisk and HDIO_GETGEO: 64 heads of 32
+ * sectors, so a cylinder is 1 MiB, as many as the 16 bits hold */
+static int rb_getgeo(struct block_device *bdev, struct hd_geometry *geo){
+    geo->heads = 64;
+    geo->sectors = 32;
+    geo->cylinders = min_t(sector_t, get_capacity(bdev->bd_disk) >> 11, U16_MAX);
+    geo->start = 0;
     return 0;
 }
 
-static void rb_release(struct gendisk *rb_disk, fmode_t mode ){
-    /* TODO */ 
-    return;
+/* Snapshots, see IO_ioctl.h; the block layer keeps the generic ioctls */
+int rb_ioctl(struct block_device *bdev, blk_mode_t mode, uint cmd, unsigned long arg){
+    struct rb_device *rb_dev = bdev->bd_disk->private_data;
+    switch(cmd){
+    case RB_IOC_SNAP_CREATE:
+        if(!capable(CAP_SYS_ADMIN))
+            return -EACCES;
+        return rb_snap_create(rb_dev, (u32 __user *)arg);
+    case RB_IOC_SNAP_DELETE:
+        if(!capable(CAP_SYS_ADMIN))
+            return -EACCES;
+        return rb_snap_delete((u32 __user *)arg);
+    default:
+        return -ENOTTY;
+    }
+}
+
+/* New disk sharing every page origin holds now. Only the split of the
+ * page index happens with origin's queue frozen, whatever its size. */
+static int rb_snap_create(struct rb_device *origin, u32 __user *argp){
+    unsigned int last = (1U << MINORBITS) / (max_part + 1) - 1;
+    struct rb_device *rb_dev;
+    struct rb_layer *base;
+    unsigned int memflags;
+    int index, status;
+    /* the image is saved from the top layer alone, zones, checksums and
+     * backing files are not shared */
+    if(origin->image || origin->zones || origin->csums || origin->file)
+        return -EOPNOTSUPP;
+    /* mapped pages are about to be frozen, yet still writable */
+    if(atomic_read(&origin->map_users))
+        return -EBUSY;
+    if(last < nr_devices)
+        return -ENOSPC;
+    index = ida_alloc_range(&rb_snap_ids, nr_devices, last, GFP_KERNEL);
+    if(index < 0)
+        return index;
+    /* the caller learns the index before the disk goes live, a fault
+     * then leaves nothing behind */
+    if(put_user(index, argp)){
+        ida_free(&rb_snap_ids, index);
+        return -EFAULT;
+    }
+    mutex_lock(&rb_devices_lock);
+    memflags = rb_freeze_queue(origin->rb_disk->queue);
+    base = rb_store_split(origin);
+    rb_unfreeze_queue(origin->rb_disk->queue, memflags);
+    if(!base){
+        status = -ENOMEM;
+        goto out;
+    }
+    rb_dev = rb_alloc_device(index, base);
+    rb_layer_put(base);
+    if(IS_ERR(rb_dev)){
+        status = PTR_ERR(rb_dev);
+        goto out;
+    }
+    list_add_tail(&rb_dev->list, &rb_devices);
+    mutex_unlock(&rb_devices_lock);
+    printk(KERN_INFO "Device %d: snapshot of device %d\n",index, origin->index);
+    return 0;
+out:
+    mutex_unlock(&rb_devices_lock);
+    ida_free(&rb_snap_ids, index);
+    return status;
+}
+
+static int rb_snap_delete(u32 __user *argp){
+    struct rb_device *rb_dev, *found = NULL;
+    u32 index;
+    if(get_user(index, argp))
+        return -EFAULT;
+    mutex_lock(&rb_devices_lock);
+    list_for_each_entry(rb_dev, &rb_devices, list){
+        if(rb_dev->index == index){
+            found = rb_dev;
+            break;
+        }
+    }
+    if(!found || !found->snapshot){
+        mutex_unlock(&rb_devices_lock);
+        return -ENODEV;
+    }
+    /* rb_open() is refused past this point, so nobody can open the disk
+     * between the check and its removal */
+    mutex_lock(&found->rb_disk->open_mutex);
+    if(disk_openers(found->rb_disk) || atomic_read(&found->map_users)){
+        mutex_unlock(&found->rb_disk->open_mutex);
+        mutex_unlock(&rb_devices_lock);
+        return -EBUSY;
+    }
+    found->dying = true;
+    mutex_unlock(&found->rb_disk->open_mutex);
+    list_del(&found->list);
+    mutex_unlock(&rb_devices_lock);
+    rb_free_device(found);
+    return 0;
+}
+
+/* Requests are served inline: there is nothing to wait for on a ramdisk,
+ * except large ones cut in chunks for IO_par.c, and those of a backing
+ * file, completed by IO_file.c. */
+static blk_status_t rb_queue_rq(struct blk_mq_hw_ctx *hctx, const struct blk_mq_queue_data *bd){
+    struct request *req = bd->rq;
+    struct rb_device *rb_dev = hctx->queue->queuedata;
+    blk_status_t status;
+    unsigned int nr;
+    u64 now = ktime_get_ns();
+    blk_mq_start_request(req);
+    if(rb_dev->file){
+        status = rb_check_io(rb_dev, req_op(req), blk_rq_pos(req), blk_rq_sectors(req));
+        if(status == BLK_STS_OK)
+            return rb_file_submit(rb_dev, req, now);
+        rb_finish_rq(req, status, now);
+        return BLK_STS_OK;
+    }
+    nr = rb_par_chunks(rb_dev, req);
+    if(nr > 1 && rb_check_io(rb_dev, req_op(req), blk_rq_pos(req), blk_rq_sectors(req)) == BLK_STS_OK){
+        rb_integ_pi(rb_dev, req, blk_rq_pos(req));
+        rb_par_submit(rb_dev, req, nr, now);
+        return BLK_STS_OK;
+    }
+    status = rb_transfer(req);
+    /* out of pages: let the block layer retry once memory is back */
+    if(status == BLK_STS_RESOURCE)
+        return status;
+    rb_finish_rq(req, status, now);
+    return BLK_STS_OK;
+}
+
+/* Complete a request served since start: on a poll queue it is left to
+ * the poller, on a shaped device it waits for the request's deadline.
+ * Backing file requests end here from their completion, which may run
+ * in interrupt context. */
+void rb_finish_rq(struct request *req, blk_status_t status, u64 start){
+    struct blk_mq_hw_ctx *hctx = req->mq_hctx;
+    struct rb_queue *rq_queue = hctx->driver_data;
+    struct rb_cmd *cmd = blk_mq_rq_to_pdu(req);
+    unsigned long flags;
+    cmd->status = status;
+    cmd->deadline = rb_shape_deadline(req->q->queuedata, blk_rq_bytes(req), start);
+    if(hctx->type == HCTX_TYPE_POLL){
+        spin_lock_irqsave(&rq_queue->poll_lock, flags);
+        list_add_tail(&req->queuelist, &rq_queue->poll_list);
+        spin_unlock_irqrestore(&rq_queue->poll_lock, flags);
+        return;
+    }
+    if(cmd->deadline){
+        hrtimer_start(&cmd->timer, ns_to_ktime(cmd->deadline), HRTIMER_MODE_ABS);
+        return;
+    }
+    blk_mq_end_request(req, status);
+}
+
+static enum hrtimer_restart rb_cmd_timer(struct hrtimer *timer){
+    struct rb_cmd *cmd = container_of(timer, struct rb_cmd, timer);
+    blk_mq_end_request(blk_mq_rq_from_pdu(cmd), cmd->status);
+    return HRTIMER_NORESTART;
+}
+
+static void rb_complete_batch(struct io_comp_batch *iob){
+    blk_mq_end_request_batch(iob);
+}
+
+/* Complete what queue_rq left on this poll queue, batched when possible;
+ * shaped requests stay until their deadline */
+static int rb_poll(struct blk_mq_hw_ctx *hctx, struct io_comp_batch *iob){
+    struct rb_queue *rq_queue = hctx->driver_data;
+    struct request *req, *next;
+    struct rb_cmd *cmd;
+    LIST_HEAD(list);
+    u64 now = ktime_get_ns();
+    unsigned long flags;
+    int nr = 0;
+    spin_lock_irqsave(&rq_queue->poll_lock, flags);
+    list_splice_init(&rq_queue->poll_list, &list);
+    spin_unlock_irqrestore(&rq_queue->poll_lock, flags);
+    list_for_each_entry_safe(req, next, &list, queuelist){
+        cmd = blk_mq_rq_to_pdu(req);
+        if(cmd->deadline > now)
+            continue;
+        list_del_init(&req->queuelist);
+        if(!blk_mq_add_to_batch(req, iob, cmd->status != BLK_STS_OK, rb_complete_batch))
+            blk_mq_end_request(req, cmd->status);
+        nr++;
+    }
+    if(!list_empty(&list)){
+        /* ahead of anything queued since */
+        spin_lock_irqsave(&rq_queue->poll_lock, flags);
+        list_splice(&list, &rq_queue->poll_list);
+        spin_unlock_irqrestore(&rq_queue->poll_lock, flags);
+    }
+    return nr;
 }
 
-static int rb_getgeo(struct block_device *rb_dev, struct hd_geometry *geo){
-    /* TODO */
+static int rb_init_hctx(struct blk_mq_hw_ctx *hctx, void *data, unsigned int hctx_idx){
+    struct rb_device *rb_dev = data;
+    struct rb_queue *rq_queue = &rb_dev->queues[hctx_idx];
+    spin_lock_init(&rq_queue->poll_lock);
+    INIT_LIST_HEAD(&rq_queue->poll_list);
+    hctx->driver_data = rq_queue;
     return 0;
 }
 
-int rb_ioctl(struct block_device *rb_dev, fmode_t mode, uint cmd, unsigned long arg){ 
-    /* TODO */
+static int rb_init_request(struct blk_mq_tag_set *set, struct request *req, unsigned int hctx_idx, unsigned int numa_node){
+    struct rb_cmd *cmd = blk_mq_rq_to_pdu(req);
+    hrtimer_setup(&cmd->timer, rb_cmd_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
     return 0;
 }
 
-void rb_request(struct request_queue *q){
-    struct request *req;
-    struct rb_device *rb_dev = q->queuedata;
-    while ((req= blk_fetch_request(rb_dev->rb_queue)) !=NULL){
-        __blk_end_request_all(req, rb_transfer(req)); 
+/* Default contexts first, then the poll ones; no separate read map */
+static void rb_map_queues(struct blk_mq_tag_set *set){
+    struct blk_mq_queue_map *map;
+    unsigned int i, cpu, qoff = 0;
+    for(i = 0; i < set->nr_maps; ++i){
+        map = &set->map[i];
+        switch(i){
+        case HCTX_TYPE_DEFAULT:
+            map->nr_queues = set->nr_hw_queues - poll_queues;
+            break;
+        case HCTX_TYPE_POLL:
+            map->nr_queues = poll_queues;
+            break;
+        default:
+            map->nr_queues = 0;
+            continue;
+        }
+        map->queue_offset = qoff;
+        qoff += map->nr_queues;
+        if(i == HCTX_TYPE_DEFAULT && queue_per_node){
+            /* Every CPU of a node submits through the same context */
+            for_each_possible_cpu(cpu)
+                map->mq_map[cpu] = map->queue_offset + cpu_to_node(cpu) % map->nr_queues;
+            continue;
+        }
+        blk_mq_map_queues(map);
     }
-    return;
 }
 
-static int rb_transfer(struct request *req){
-    struct req_iterator it;
+/* Bio-based fast path: walk the bio_vecs and complete inline, like brd */
+static void rb_submit_bio(struct bio *bio){
+    struct rb_device *rb_dev = bio->bi_bdev->bd_disk->private_data;
+    struct bvec_iter iter;
     struct bio_vec bv;
+    struct rb_csum csum, *cs;
+    unsigned int segs = 0;
+    u64 start = ktime_get_ns();
+    int write, err = 0;
+    bool stream;
+    gfp_t gfp;
+    bio->bi_status = rb_check_io(rb_dev, bio_op(bio), bio->bi_iter.bi_sector, bio_sectors(bio));
+    if(bio->bi_status != BLK_STS_OK){
+        bio_endio(bio);
+        return;
+    }
+    gfp = bio->bi_opf & REQ_NOWAIT ? GFP_NOWAIT : GFP_NOIO;
+    /* what a cached device holds goes down before the data */
+    if(bio->bi_opf & REQ_PREFLUSH){
+        err = rb_cache_flush(rb_dev);
+        if(err){
+            rb_bio_error(bio, err);
+            return;
+        }
+    }
+    if(!rb_op_has_data(bio_op(bio))){
+        err = rb_do_nodata(rb_dev, bio_op(bio), bio->bi_opf, bio->bi_iter.bi_sector, bio_sectors(bio), gfp);
+        if(err){
+            rb_bio_error(bio, err);
+            return;
+        }
+        rb_end_io(rb_dev, bio_op(bio), bio->bi_iter.bi_size, 0, start);
+        bio_endio(bio);
+        return;
+    }
+    write = op_is_write(bio_op(bio));
+    stream = rb_copy_stream(rb_dev, bio->bi_iter.bi_size);
+    cs = rb_integ_begin(rb_dev, &csum, bio->bi_iter.bi_sector, write);
+    bio_for_each_bvec(bv,bio,iter){
+        err = rb_do_bvec(rb_dev, &bv, iter.bi_sector, write, cs, stream, gfp);
+        if(err)
+            break;
+        segs++;
+    }
+    rb_integ_end(cs);
+    if(!err && write && bio->bi_opf & REQ_FUA)
+        err = rb_cache_fua(rb_dev, bio->bi_iter.bi_sector, bio_sectors(bio));
+    if(err){
+        rb_bio_error(bio, err);
+        return;
+    }
+    rb_end_io(rb_dev, bio_op(bio), bio->bi_iter.bi_size, segs, start);
+    bio_endio(bio);
+}
+
+/* Fail a bio, telling REQ_NOWAIT submitters to retry where they may block */
+static void rb_bio_error(struct bio *bio, int err){
+    if(err == -ENOMEM && bio->bi_opf & REQ_NOWAIT)
+        bio_wouldblock_error(bio);
+    else
+        bio_io_error(bio);
+}
+
+/* Operations we accept, within the bounds of the device */
+static blk_status_t rb_check_io(struct rb_device *rb_dev, enum req_op op, sector_t beg, sector_t size){
+    switch(op){
+    case REQ_OP_READ:
+    case REQ_OP_WRITE:
+    case REQ_OP_FLUSH:
+    case REQ_OP_DISCARD:
+    case REQ_OP_WRITE_ZEROES:
+        break;
+    case REQ_OP_ZONE_APPEND:
+    case REQ_OP_ZONE_OPEN:
+    case REQ_OP_ZONE_CLOSE:
+    case REQ_OP_ZONE_FINISH:
+    case REQ_OP_ZONE_RESET:
+    case REQ_OP_ZONE_RESET_ALL:
+        if(!rb_dev->zones)
+            return BLK_STS_NOTSUPP;
+        break;
+    default:
+        return BLK_STS_NOTSUPP;
+    }
+    if(beg + size > rb_dev->size)
+        return BLK_STS_IOERR;
+    return BLK_STS_OK;
+}
+
+static bool rb_op_has_data(enum req_op op){
+    return op == REQ_OP_READ || op == REQ_OP_WRITE || op == REQ_OP_ZONE_APPEND;
+}
+
+/* Requests without data: discards, write-zeroes and zone resets give
+ * pages back, flushes reach a cached device */
+static int rb_do_nodata(struct rb_device *rb_dev, enum req_op op, blk_opf_t opf, sector_t beg, sector_t size, gfp_t gfp){
+    switch(op){
+    case REQ_OP_DISCARD:
+        return rb_integ_discard(rb_dev, beg, size, true, gfp);
+    case REQ_OP_WRITE_ZEROES:
+        /* REQ_NOUNMAP asks us to keep the range provisioned */
+        return rb_integ_discard(rb_dev, beg, size, !(opf & REQ_NOUNMAP), gfp);
+    case REQ_OP_ZONE_OPEN:
+    case REQ_OP_ZONE_CLOSE:
+    case REQ_OP_ZONE_FINISH:
+    case REQ_OP_ZONE_RESET:
+    case REQ_OP_ZONE_RESET_ALL:
+        return rb_zone_mgmt(rb_dev, op, beg, gfp);
+    case REQ_OP_FLUSH:
+        return rb_cache_flush(rb_dev);
+    default:
+        return 0;
+    }
+}
+
+/* Between a mapped buffer and the store, through the checksums if cs */
+static int rb_do_copy(struct rb_device *rb_dev, void *buffer, sector_t sector, unsigned int len, int write, struct rb_csum *cs, bool stream, gfp_t gfp){
+    if(cs)
+        return rb_integ_copy(rb_dev, cs, buffer, sector, len, stream, gfp);
+    if(write)
+        return rb_store_write(rb_dev, buffer, sector, len, stream, gfp);
+    return rb_store_read(rb_dev, buffer, sector, len, stream);
+}
+
+/* Copy one bio_vec, possibly spanning several pages, between the
+ * caller's pages and our storage. Without highmem it is linear in the
+ * kernel mapping and goes to the store whole, which can then copy across
+ * a huge folio 64 KiB at a time; else one page mapping at a time. cs is the
+ * transfer's running checksum, NULL without integrity. */
+int rb_do_bvec(struct rb_device *rb_dev, struct bio_vec *bv, sector_t sector, int write, struct rb_csum *cs, bool stream, gfp_t gfp){
+    unsigned int offset = bv->bv_offset, len = bv->bv_len, chunk;
     char *buffer;
-    unsigned int num_sector, tot_sector; 
+    int err = 0;
+    if(bv->bv_len % KERNEL_SECTOR_SIZE){
+        this_cpu_inc(rb_dev->stats->misaligned);
+        printk_ratelimited(KERN_ALERT "bio vector size %u is illegal\n",bv->bv_len % KERNEL_SECTOR_SIZE);
+    }
+    if(!IS_ENABLED(CONFIG_HIGHMEM))
+        return rb_do_copy(rb_dev, bvec_virt(bv), sector, len, write, cs, stream, gfp);
+    while(len && !err){
+        chunk = min_t(unsigned int, len, PAGE_SIZE - offset_in_page(offset));
+        buffer = kmap_local_page(nth_page(bv->bv_page, offset >> PAGE_SHIFT));
+        err = rb_do_copy(rb_dev, buffer + offset_in_page(offset), sector, chunk, write, cs, stream, gfp);
+        kunmap_local(buffer);
+        offset += chunk;
+        sector += chunk >> SECTOR_SHIFT;
+        len -= chunk;
+    }
+    return err;
+}
+
+/* Out of memory is worth a retry, anything else fails the request */
+static blk_status_t rb_errno_to_status(int err){
+    if(err == -ENOMEM)
+        return BLK_STS_RESOURCE;
+    return errno_to_blk_status(err);
+}
+
+static blk_status_t rb_transfer(struct request *req){
+    struct rb_device *rb_dev = req->q->queuedata;
+    struct req_iterator it;
+    struct bio_vec bv;
+    struct rb_csum csum, *cs;
+    unsigned int num_sector, tot_sector, segs;
     int write;
-    sector_t beg, size;
+    bool stream;
+    sector_t beg, size, sector;
+    blk_status_t status;
+    gfp_t gfp;
+    int err = 0;
+    u64 start = ktime_get_ns();
     tot_sector = 0;
+    segs = 0;
     write = rq_data_dir(req);
     beg = blk_rq_pos(req);
     size = blk_rq_sectors(req);
-    rq_for_each_segment(bv,req,it){
-        buffer = page_address(bv.bv_page)+bv.bv_offset;
-        if(bv.bv_len % KERNEL_SECTOR_SIZE)
-            printk(KERN_ALERT "bio vector size %u is illegal\n",bv.bv_len % KERNEL_SECTOR_SIZE);
+    status = rb_check_io(rb_dev, req_op(req), beg, size);
+    if(status != BLK_STS_OK)
+        return status;
+    /* queue_rq must not sleep, so no reclaim from here unless BLK_MQ_F_BLOCKING */
+    gfp = rb_dev->blocking ? GFP_NOIO : GFP_NOWAIT | __GFP_NOWARN;
+    if(!rb_op_has_data(req_op(req))){
+        err = rb_do_nodata(rb_dev, req_op(req), req->cmd_flags, beg, size, gfp);
+        if(err)
+            return rb_errno_to_status(err);
+        rb_end_io(rb_dev, req_op(req), blk_rq_bytes(req), 0, start);
+        return BLK_STS_OK;
+    }
+    /* zone appends land at the write pointer */
+    if(rb_dev->zones && write){
+        err = rb_zone_write_begin(rb_dev, req_op(req), &beg, size);
+        if(err)
+            return rb_errno_to_status(err);
+    }
+    sector = beg;
+    stream = rb_copy_stream(rb_dev, blk_rq_bytes(req));
+    cs = rb_integ_begin(rb_dev, &csum, sector, write);
+    rq_for_each_bvec(bv,req,it){
+        segs++;
         num_sector = bv.bv_len / KERNEL_SECTOR_SIZE;
         tot_sector +=num_sector;
-        if(write){
-            memcpy(b_dev.data+(KERNEL_SECTOR_SIZE*it.iter.bi_sector),buffer,bv.bv_len*sizeof(char)); 
-        }else{
-            memcpy(buffer,b_dev.data+(KERNEL_SECTOR_SIZE*it.iter.bi_sector),bv.bv_len*sizeof(char)); 
-        }
+        err = rb_do_bvec(rb_dev, &bv, sector, write, cs, stream, gfp);
+        if(err)
+            break;
+        sector += num_sector;
     }
+    rb_integ_end(cs);
+    if(!err)
+        rb_integ_pi(rb_dev, req, beg);
+    if(rb_dev->zones && write)
+        rb_zone_write_end(rb_dev, beg, size, !err);
+    /* blk-mq sent the preflush ahead as a REQ_OP_FLUSH */
+    if(!err && write && req->cmd_flags & REQ_FUA)
+        err = rb_cache_fua(rb_dev, beg, size);
+    if(err)
+        return rb_errno_to_status(err);
     if(tot_sector != size)
-            printk(KERN_NOTICE "Warning, %u != %lu", tot_sector, size);
-    return 0;
+            printk(KERN_NOTICE "Warning, %u != %llu", tot_sector, (unsigned long long)size);
+    if(req_op(req) == REQ_OP_ZONE_APPEND)
+        req->__sector = beg;
+    rb_end_io(rb_dev, req_op(req), blk_rq_bytes(req), segs, start);
+    return BLK_STS_OK;
 }
 
-int rb_init(void){
+/* Account a request served since start (ktime_get_ns) */
+static void rb_end_io(struct rb_device *rb_dev, enum req_op op, unsigned int bytes, unsigned int segs, u64 start){
+    rb_stats_account(rb_dev, op, bytes, segs, ktime_get_ns() - start);
+}
+
+static int __init rb_init(void){
+    struct rb_device *rb_dev, *next;
+    unsigned int i;
     int status;
     printk(KERN_ALERT "Hello %s !\n", name);
+    if(!size_kb || !nr_devices){
+        printk(KERN_ERR "size_kb and nr_devices must not be 0\n");
+        return -EINVAL;
+    }
+    if(queue_mode != RB_Q_BIO && queue_mode != RB_Q_MQ){
+        printk(KERN_ERR "Invalid queue_mode %d\n",queue_mode);
+        return -EINVAL;
+    }
+    if(numa_policy < RB_NUMA_LOCAL || numa_policy > RB_NUMA_INTERLEAVE){
+        printk(KERN_ERR "Invalid numa_policy %d\n",numa_policy);
+        return -EINVAL;
+    }
+    if(home_node != NUMA_NO_NODE && (home_node < 0 || home_node >= nr_node_ids || !node_online(home_node))){
+        printk(KERN_ERR "Node %d is not online\n",home_node);
+        return -EINVAL;
+    }
+    if(logical_block_size < KERNEL_SECTOR_SIZE || logical_block_size > PAGE_SIZE || !is_power_of_2(logical_block_size)){
+        printk(KERN_ERR "Invalid logical_block_size %u\n",logical_block_size);
+        return -EINVAL;
+    }
+    if(physical_block_size && (physical_block_size < logical_block_size || !is_power_of_2(physical_block_size))){
+        printk(KERN_ERR "Invalid physical_block_size %u\n",physical_block_size);
+        return -EINVAL;
+    }
+    if(((u64)size_kb * 1024) % logical_block_size){
+        printk(KERN_ERR "size_kb is not a multiple of %u bytes\n",logical_block_size);
+        return -EINVAL;
+    }
+    if(max_segment_size && max_segment_size < PAGE_SIZE){
+        printk(KERN_ERR "max_segment_size must be at least %lu\n",PAGE_SIZE);
+        return -EINVAL;
+    }
+    if(poll_queues && queue_mode != RB_Q_MQ){
+        printk(KERN_ERR "poll_queues needs queue_mode=%d\n",RB_Q_MQ);
+        return -EINVAL;
+    }
+    if(zoned && (queue_mode != RB_Q_MQ || image[0])){
+        printk(KERN_ERR "zoned needs queue_mode=%d and no image\n",RB_Q_MQ);
+        return -EINVAL;
+    }
+    if(mmap_dev && (comp_algo[0] || zoned)){
+        printk(KERN_ERR "mmap_dev needs plain pages, without comp_algo nor zoned\n");
+        return -EINVAL;
+    }
+    if(tier_ram_mb && ((!image[0] && !cache_dev[0]) || comp_algo[0] || zoned || mmap_dev)){
+        printk(KERN_ERR "tier_ram_mb needs image or cache_dev, without comp_algo, zoned nor mmap_dev\n");
+        return -EINVAL;
+    }
+    if(huge_pages && (comp_algo[0] || mmap_dev || tier_ram_mb)){
+        printk(KERN_ERR "huge_pages needs plain pages, without comp_algo, mmap_dev nor tier_ram_mb\n");
+        return -EINVAL;
+    }
+    if(par_threads && (queue_mode != RB_Q_MQ || zoned || par_threads > RB_PAR_MAX)){
+        printk(KERN_ERR "par_threads needs queue_mode=%d, no zoned, and at most %d\n",RB_Q_MQ, RB_PAR_MAX);
+        return -EINVAL;
+    }
+    /* the file replaces the page store, requests wait for it */
+    if(backing_file[0] && (queue_mode != RB_Q_MQ || poll_queues || image[0] || comp_algo[0] || zoned || mmap_dev || huge_pages || par_threads || integrity)){
+        printk(KERN_ERR "backing_file needs queue_mode=%d, without poll_queues, image, comp_algo, zoned, mmap_dev, huge_pages, par_threads nor integrity\n",RB_Q_MQ);
+        return -EINVAL;
+    }
+    /* one lower device, behind the image machinery and the page store */
+    if(cache_dev[0] && (nr_devices > 1 || image[0] || comp_algo[0] || zoned || mmap_dev || par_threads || integrity || backing_file[0])){
+        printk(KERN_ERR "cache_dev needs nr_devices=1, without image, comp_algo, zoned, mmap_dev, par_threads, integrity nor backing_file\n");
+        return -EINVAL;
+    }
+    if(integrity < RB_INTEG_OFF || integrity > RB_INTEG_PI){
+        printk(KERN_ERR "Invalid integrity %d\n",integrity);
+        return -EINVAL;
+    }
+    /* pages of the image and mapped ones are written around the checksums */
+    if(integrity && (image[0] || mmap_dev)){
+        printk(KERN_ERR "integrity needs no image nor mmap_dev\n");
+        return -EINVAL;
+    }
+    if(integrity == RB_INTEG_PI && (queue_mode != RB_Q_MQ || !IS_ENABLED(CONFIG_BLK_DEV_INTEGRITY))){
+        printk(KERN_ERR "integrity=%d needs queue_mode=%d and CONFIG_BLK_DEV_INTEGRITY\n",RB_INTEG_PI, RB_Q_MQ);
+        return -EINVAL;
+    }
+    if(par_copy_kb > UINT_MAX / 1024 || nt_copy_kb > UINT_MAX / 1024){
+        printk(KERN_ERR "par_copy_kb and nt_copy_kb must be below 4 TiB\n");
+        return -EINVAL;
+    }
+    if(zoned && (!is_power_of_2(zone_size_kb) || zone_size_kb * 1024 < PAGE_SIZE)){
+        printk(KERN_ERR "Invalid zone_size_kb %lu\n",zone_size_kb);
+        return -EINVAL;
+    }
+    if(max_part >= DISK_MAX_PARTS || (u64)nr_devices * (max_part + 1) > 1U << MINORBITS){
+        printk(KERN_ERR "Not enough minors for %u devices with %u partitions\n", nr_devices, max_part);
+        return -EINVAL;
+    }
+    rb_copy_init();
+    if(comp_algo[0]){
+        status = rb_comp_init(comp_algo);
+        if(status)
+            return status;
+    }
+    if(par_threads){
+        status = rb_par_init();
+        if(status){
+            rb_comp_exit();
+            return status;
+        }
+    }
     status = register_blkdev(DEF_MAJOR, name);
     if(status < 0){
         printk(KERN_ERR "Unable to register %s\n",name);
+        rb_par_exit();
+        rb_comp_exit();
         return -EBUSY;
     }
-    b_dev.major = status;
-    b_dev.data = kmalloc(SECSIZE*KERNEL_SECTOR_SIZE, GFP_KERNEL);
-    status = init_queue(&b_dev);
-    if(status < 0)
-        return status;
-    b_dev.size = SECSIZE;
-    status = create_gendisk(&b_dev,b_dev.major);
-    if(status < 0)
-        printk(KERN_ALERT "gendisk KO %d", status);
-        return status;
+    rb_major = status;
+    rb_debugfs_init(name);
+    for(i = 0; i < nr_devices; ++i){
+        rb_dev = rb_alloc_device(i, NULL);
+        if(IS_ERR(rb_dev)){
+            status = PTR_ERR(rb_dev);
+            goto out_free;
+        }
+        mutex_lock(&rb_devices_lock);
+        list_add_tail(&rb_dev->list, &rb_devices);
+        mutex_unlock(&rb_devices_lock);
+    }
     return 0;
+out_free:
+    list_for_each_entry_safe(rb_dev, next, &rb_devices, list){
+        list_del(&rb_dev->list);
+        rb_free_device(rb_dev);
+    }
+    rb_debugfs_exit();
+    unregister_blkdev(rb_major,name);
+    rb_par_exit();
+    rb_comp_exit();
+    return status;
+}
+
+/* One disk with its own queue and backing store, stacked over base for
+ * a snapshot */
+static struct rb_device *rb_alloc_device(int index, struct rb_layer *base){
+    struct rb_device *rb_dev;
+    char *path;
+    int status;
+    rb_dev = kzalloc(sizeof(*rb_dev), GFP_KERNEL);
+    if(!rb_dev)
+        return ERR_PTR(-ENOMEM);
+    rb_dev->index = index;
+    rb_dev->major = rb_major;
+    rb_dev->size = (sector_t)size_kb * (1024 / KERNEL_SECTOR_SIZE);
+    rb_dev->comp = comp_algo[0] != '\0';
+    rb_dev->huge = huge_pages;
+    rb_dev->par_threads = par_threads;
+    rb_dev->par_bytes = par_copy_kb * 1024;
+    rb_dev->nt_bytes = nt_copy_kb * 1024;
+    rb_dev->snapshot = base != NULL;
+    rb_dev->numa_policy = numa_policy;
+    rb_dev->node = NUMA_NO_NODE;
+    /* devices bound without an explicit home_node are spread over the nodes */
+    if(numa_policy == RB_NUMA_NODE)
+        rb_dev->node = home_node != NUMA_NO_NODE ? home_node : rb_nth_online_node(index);
+    rb_shape_init(rb_dev);
+    rb_dev->stats = alloc_percpu(struct rb_stats);
+    if(!rb_dev->stats){
+        kfree(rb_dev);
+        return ERR_PTR(-ENOMEM);
+    }
+    status = rb_store_init(rb_dev, base);
+    if(status)
+        goto out_free;
+    if(image[0]){
+        path = nr_devices > 1 ? kasprintf(GFP_KERNEL, "%s.%d", image, index) : image;
+        if(!path){
+            status = -ENOMEM;
+            goto out_free;
+        }
+        status = rb_image_open(rb_dev, path);
+        if(path != image)
+            kfree(path);
+        if(status)
+            goto out_free;
+        /* pages are read back from the file on first access */
+        rb_dev->blocking = true;
+    }
+    if(cache_dev[0]){
+        status = rb_cache_open(rb_dev, cache_dev, cache_flush_ms);
+        if(status)
+            goto out_free;
+        /* misses and flushes wait for the lower device */
+        rb_dev->blocking = true;
+    }
+    if(backing_file[0]){
+        path = nr_devices > 1 ? kasprintf(GFP_KERNEL, "%s.%d", backing_file, index) : backing_file;
+        if(!path){
+            status = -ENOMEM;
+            goto out_free;
+        }
+        status = rb_file_open(rb_dev, path, logical_block_size);
+        if(path != backing_file)
+            kfree(path);
+        if(status)
+            goto out_free;
+        /* submitting to the file system may sleep */
+        rb_dev->blocking = true;
+    }
+    if(integrity){
+        status = rb_integ_init(rb_dev, integrity, logical_block_size);
+        if(status)
+            goto out_zones;
+        /* writes wait for their region's lock */
+        rb_dev->blocking = true;
+    }
+    if(tier_ram_mb){
+        status = rb_tier_init(rb_dev, tier_ram_mb << (20 - PAGE_SHIFT));
+        if(status)
+            goto out_zones;
+    }
+    if(zoned){
+        status = rb_zoned_init(rb_dev, (sector_t)zone_size_kb * (1024 / KERNEL_SECTOR_SIZE), zone_nr_conv);
+        if(status)
+            goto out_zones;
+        /* writes wait for their zone's lock */
+        rb_dev->blocking = true;
+    }
+    if(queue_mode == RB_Q_MQ){
+        status = init_queue(rb_dev);
+        if(status < 0)
+            goto out_zones;
+    }
+    status = create_gendisk(rb_dev,rb_dev->major);
+    if(status < 0){
+        printk(KERN_ALERT "gendisk KO %d", status);
+        goto out_tags;
+    }
+    if(mmap_dev){
+        status = rb_map_add(rb_dev);
+        if(status)
+            goto out_disk;
+    }
+    rb_debugfs_add(rb_dev);
+    return rb_dev;
+out_disk:
+    delete_gendisk(rb_dev);
+out_tags:
+    if(queue_mode == RB_Q_MQ){
+        blk_mq_free_tag_set(&rb_dev->tag_set);
+        kfree(rb_dev->queues);
+    }
+out_zones:
+    rb_zoned_free(rb_dev);
+    rb_tier_free(rb_dev);
+    rb_integ_free(rb_dev);
+    rb_file_close(rb_dev);
+    rb_cache_close(rb_dev, false);
+    rb_image_close(rb_dev, false);
+out_free:
+    rb_store_free(rb_dev);
+    free_percpu(rb_dev->stats);
+    kfree(rb_dev);
+    return ERR_PTR(status);
+}
+
+static void rb_free_device(struct rb_device *rb_dev){
+    rb_map_remove(rb_dev);
+    rb_debugfs_remove(rb_dev);
+    delete_gendisk(rb_dev);
+    if(queue_mode == RB_Q_MQ){
+        blk_mq_free_tag_set(&rb_dev->tag_set);
+        kfree(rb_dev->queues);
+    }
+    rb_zoned_free(rb_dev);
+    rb_tier_free(rb_dev);
+    rb_integ_free(rb_dev);
+    rb_file_close(rb_dev);
+    rb_cache_close(rb_dev, true);
+    rb_image_close(rb_dev, true);
+    rb_store_free(rb_dev);
+    if(rb_dev->snapshot)
+        ida_free(&rb_snap_ids, rb_dev->index);
+    free_percpu(rb_dev->stats);
+    kfree(rb_dev);
 }
 
 int init_queue(struct rb_device *rb_dev){
-    spin_lock_init(&rb_dev->lock);
-    rb_dev->rb_queue = blk_init_queue(rb_request,&rb_dev->lock);
-    if(rb_dev->rb_queue == NULL)
+    struct blk_mq_tag_set *set = &rb_dev->tag_set;
+    int status;
+    memset(set, 0, sizeof(*set));
+    set->ops = &rb_mq_ops;
+    set->nr_maps = poll_queues ? HCTX_MAX_TYPES : 1;
+    set->nr_hw_queues = nr_hw_queues;
+    if(!set->nr_hw_queues)
+        set->nr_hw_queues = queue_per_node ? nr_node_ids : nr_cpu_ids;
+    set->nr_hw_queues += poll_queues;
+    set->queue_depth = queue_depth;
+    set->cmd_size = struct_size_t(struct rb_cmd, par, rb_dev->par_threads);
+    /* tags and contexts live next to the pages they will touch */
+    set->numa_node = rb_dev->node;
+    /* merging is the default from 6.14 on, and the flag gone */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 14, 0)
+    set->flags = BLK_MQ_F_SHOULD_MERGE;
+#endif
+    if(rb_dev->blocking)
+        set->flags |= BLK_MQ_F_BLOCKING;
+    set->driver_data = rb_dev;
+    rb_dev->queues = kcalloc(set->nr_hw_queues, sizeof(*rb_dev->queues), GFP_KERNEL);
+    if(!rb_dev->queues)
         return -ENOMEM;
-    rb_dev->rb_queue->queuedata = rb_dev;
-    return 0;
+    status = blk_mq_alloc_tag_set(set);
+    if(status){
+        kfree(rb_dev->queues);
+        rb_dev->queues = NULL;
+    }
+    return status;
 }
 
 int create_gendisk(struct rb_device *rb_dev, int maj){
-    rb_dev->rb_disk=alloc_disk(BLOCK_MINORS);
-    if(!rb_dev->rb_disk){
-        printk(KERN_NOTICE "alloc_disk failed for %s\n",name);
-        return -ENOMEM;
+    struct queue_limits lim = {
+        .logical_block_size = logical_block_size,
+        .physical_block_size = physical_block_size,
+        /* 0 leaves the block layer's default */
+        .max_hw_sectors = max_sectors,
+        .max_segments = max_segments,
+        .max_segment_size = max_segment_size,
+        /* discarded pages are freed, anything smaller is just zeroed */
+        .max_hw_discard_sectors = UINT_MAX >> SECTOR_SHIFT,
+        .discard_granularity = PAGE_SIZE,
+        .max_write_zeroes_sectors = UINT_MAX >> SECTOR_SHIFT,
+    };
+    struct gendisk *disk;
+    int status;
+    if(rb_dev->zones){
+        lim.features |= BLK_FEAT_ZONED;
+        lim.chunk_sectors = 1U << rb_dev->zone_shift;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 13, 0)
+        lim.max_zone_append_sectors = lim.chunk_sectors;
+#else
+        lim.max_hw_zone_append_sectors = lim.chunk_sectors;
+#endif
+        /* space comes back through zone resets, and write-zeroes would
+         * have to follow the write pointer */
+        lim.max_hw_discard_sectors = 0;
+        lim.discard_granularity = 0;
+        lim.max_write_zeroes_sectors = 0;
+    }
+    if(rb_dev->file){
+        /* the file system has caches of its own, and holes for discards */
+        lim.features |= BLK_FEAT_WRITE_CACHE | BLK_FEAT_FUA;
+        lim.dma_alignment = rb_dev->file_mem_align - 1;
+        lim.discard_granularity = logical_block_size;
+        if(!rb_dev->file->f_op->fallocate){
+            lim.max_hw_discard_sectors = 0;
+            lim.discard_granularity = 0;
+            lim.max_write_zeroes_sectors = 0;
+        }
+    }
+    if(rb_dev->cache_dirty){
+        /* writes are absorbed until a flush, or FUA, sends them down */
+        lim.features |= BLK_FEAT_WRITE_CACHE | BLK_FEAT_FUA;
+    }
+    if(rb_dev->csums){
+        /* pages are left alone while written, so what was summed is
+         * what the caller meant */
+        lim.features |= BLK_FEAT_STABLE_WRITES;
+    }
+    if(rb_dev->pi){
+        /* T10-PI type 1 tuples, generated and checked by the block layer;
+         * they are copied by the CPU, in as many segments as they come */
+        lim.integrity.tuple_size = sizeof(struct t10_pi_tuple);
+        lim.integrity.csum_type = BLK_INTEGRITY_CSUM_CRC;
+        lim.integrity.flags = BLK_INTEGRITY_REF_TAG;
+        lim.max_integrity_segments = USHRT_MAX;
+    }
+    if(queue_mode == RB_Q_BIO){
+        /* Nothing in the bio path defers completion, nor sleeps
+         * unless pages may have to be read from elsewhere */
+        lim.features |= BLK_FEAT_SYNCHRONOUS;
+        if(!rb_dev->blocking)
+            lim.features |= BLK_FEAT_NOWAIT;
+        disk = blk_alloc_disk(&lim, rb_dev->node);
+    }else{
+        disk = blk_mq_alloc_disk(&rb_dev->tag_set, &lim, rb_dev);
+    }
+    if(IS_ERR(disk)){
+        printk(KERN_NOTICE "Disk allocation failed for %s\n",name);
+        return PTR_ERR(disk);
     }
-    rb_dev->rb_disk->major = maj;
-    rb_dev->rb_disk->first_minor = 0;
-    rb_dev->rb_disk->fops = &rb_fops;
-    rb_dev->rb_disk->queue = rb_dev->rb_queue;
-    rb_dev->rb_disk->private_data = rb_dev;
-    snprintf(rb_dev->rb_disk->disk_name, 32, BLOCKNAME);
+    disk->major = maj;
+    disk->minors = max_part + 1;
+    disk->first_minor = rb_dev->index * disk->minors;
+    disk->fops = queue_mode == RB_Q_BIO ? &rb_bio_fops : &rb_fops;
+    disk->private_data = rb_dev;
+    snprintf(disk->disk_name, DISK_NAME_LEN, BLOCKNAME "%d", rb_dev->index);
     /* rb_disk init complete */
-    set_capacity(rb_dev->rb_disk,rb_dev->size);
-    add_disk(rb_dev->rb_disk);
+    set_capacity(disk,rb_dev->size);
+    if(rb_dev->zones){
+        status = blk_revalidate_disk_zones(disk);
+        if(status){
+            put_disk(disk);
+            return status;
+        }
+    }
+    status = device_add_disk(NULL, disk, rb_disk_groups);
+    if(status){
+        put_disk(disk);
+        return status;
+    }
+    rb_dev->rb_disk = disk;
     return 0;
 }
 
 static void delete_gendisk(struct rb_device *rb_dev){
     if(rb_dev->rb_disk){
         del_gendisk(rb_dev->rb_disk);
+        put_disk(rb_dev->rb_disk);
     }
     return;
 }
 
-static void rb_cleanup(void)
+static void __exit rb_cleanup(void)
 {
-    delete_gendisk(&b_dev);
-    put_disk(b_dev.rb_disk);
-    if(b_dev.rb_queue)
-        blk_cleanup_queue(b_dev.rb_queue);
-    kfree(b_dev.data);
-    unregister_blkdev(b_dev.major,name);
+    struct rb_device *rb_dev, *next;
+    list_for_each_entry_safe(rb_dev, next, &rb_devices, list){
+        list_del(&rb_dev->list);
+        rb_free_device(rb_dev);
+    }
+    ida_destroy(&rb_snap_ids);
+    rb_debugfs_exit();
+    unregister_blkdev(rb_major,name);
+    rb_par_exit();
+    rb_comp_exit();
     printk(KERN_ALERT "Goodbye %s\n", name);
 }
 
@@ -192,4 +1149,3 @@ module_init(rb_init);
 MODULE_LICENSE(LICENCE);
 MODULE_AUTHOR(AUTEUR);
 MODULE_DESCRIPTION(DESCRIPTION);
-MODULE_SUPPORTED_DEVICE(DEVICE);
@@ -0,0 +1,412 @@
+/* Shared definitions of the ramdisk driver */
+#ifndef IO_DRIVER_H
+#define IO_DRIVER_H
+
+#include <linux/types.h>
+#include <linux/list.h>
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/xarray.h>
+#include <linux/spinlock.h>
+#include <linux/atomic.h>
+#include <linux/mutex.h>
+#include <linux/refcount.h>
+#include <linux/hrtimer.h>
+#include <linux/miscdevice.h>
+#include <linux/workqueue.h>
+#include <linux/fs.h>
+#include <linux/version.h>
+
+/* queue_limits features and the integrity settings in them */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 11, 0)
+#error "IO_ramdisk needs Linux 6.11 or later"
+#endif
+
+/* Interfaces that changed since: hrtimer_setup() came in 6.13, queue
+ * freezing returns the memalloc flags to give back from 6.14 on */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 13, 0)
+static inline void hrtimer_setup(struct hrtimer *timer, enum hrtimer_restart (*function)(struct hrtimer *), clockid_t clock_id, enum hrtimer_mode mode){
+    hrtimer_init(timer, clock_id, mode);
+    timer->function = function;
+}
+#endif
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 14, 0)
+static inline unsigned int rb_freeze_queue(struct request_queue *q){
+    blk_mq_freeze_queue(q);
+    return 0;
+}
+
+static inline void rb_unfreeze_queue(struct request_queue *q, unsigned int memflags){
+    blk_mq_unfreeze_queue(q);
+}
+#else
+#define rb_freeze_queue blk_mq_freeze_queue
+#define rb_unfreeze_queue blk_mq_unfreeze_queue
+#endif
+
+#define KERNEL_SECTOR_SIZE 512  /* page4, sector size 512o*/
+#define PAGE_SECTORS_SHIFT (PAGE_SHIFT - SECTOR_SHIFT)
+#define PAGE_SECTORS (1 << PAGE_SECTORS_SHIFT)
+
+/* numa_policy values: where backing pages are allocated */
+#define RB_NUMA_LOCAL 0         /* node of the CPU doing the first write */
+#define RB_NUMA_NODE 1          /* the device's home node */
+#define RB_NUMA_INTERLEAVE 2    /* round-robin over online nodes */
+
+/* Directions of struct rb_stats arrays */
+#define RB_STAT_READ 0
+#define RB_STAT_WRITE 1
+#define RB_STAT_DISCARD 2           /* discards and write-zeroes */
+#define RB_STAT_DIRS 3
+
+#define RB_HIST_BUCKETS 32          /* log2 buckets, the last one open-ended */
+
+#define RB_SLOT_LOCKS 64            /* page lock stripes, a power of 2 */
+#define RB_PAR_MAX 16               /* most chunks par_threads cuts a request in */
+
+/* integrity values */
+#define RB_INTEG_OFF 0
+#define RB_INTEG_CSUM 1             /* crc32c of each logical block */
+#define RB_INTEG_PI 2               /* ... and a T10-PI profile */
+
+/* shape_latency_dist values */
+#define RB_LAT_FIXED 0              /* always the mean */
+#define RB_LAT_UNIFORM 1            /* 0 to twice the mean */
+#define RB_LAT_EXP 2                /* exponential around the mean */
+
+/* Entries of a page index: a bare page, a struct rb_obj tagged
+ * RB_ENTRY_OBJ holding the page in another form, or the word a page is
+ * filled with, shifted above an RB_ENTRY_FILL tag */
+#define RB_ENTRY_OBJ 1
+#define RB_ENTRY_FILL 3
+
+struct rb_obj {
+    unsigned int len;               /* Compressed length */
+    u8 data[];
+};
+
+/* A page index, stacked over the older one it was split from. Only a
+ * device's top layer is written; the layers below are frozen, shared by
+ * the snapshots taken from them, and read through where the top has no
+ * entry. A zero fill in an upper layer hides the page below. */
+struct rb_layer {
+    refcount_t ref;                 /* Layers and devices stacked on it */
+    struct xarray pages;
+    struct rb_layer *parent;        /* Older layer, NULL at the bottom */
+};
+
+/* Per-CPU counters, summed when read */
+struct rb_stats {
+    u64 ops[RB_STAT_DIRS];
+    u64 bytes[RB_STAT_DIRS];
+    u64 lat_hist[RB_STAT_DIRS][RB_HIST_BUCKETS]; /* Service time, in ns */
+    u64 segments;                   /* bio_vecs moved */
+    u64 seg_hist[RB_HIST_BUCKETS];  /* bio_vecs per request */
+    u64 misaligned;                 /* bio_vecs not a multiple of a sector */
+    u64 numa_local;                 /* Page accesses from the page's node */
+    u64 numa_remote;                /* Page accesses across the interconnect */
+    u64 tier_hits;                  /* Tiered accesses finding the page in RAM */
+    u64 tier_misses;                /* ... finding it demoted */
+    u64 tier_demoted;               /* Pages written out to the image */
+    u64 huge_folios;                /* huge_pages folios put in the store */
+    u64 huge_fallbacks;             /* ... not allocated, single pages used */
+    u64 integ_verified;             /* Blocks read and checked */
+    u64 integ_rechecked;            /* ... checked again under their lock */
+    u64 integ_errors;               /* ... not matching their checksum */
+    u64 cache_hits;                 /* cache_dev accesses served from RAM */
+    u64 cache_misses;               /* ... read in from the lower device */
+    u64 cache_written;              /* Dirty pages written back */
+    u64 cache_batches;              /* ... in that many writes */
+    u64 cache_syncs;                /* Flushes and FUA writes made durable */
+};
+
+/* Compressed store footprint */
+struct rb_comp_stats {
+    atomic_long_t pages;            /* Pages held compressed */
+    atomic_long_t bytes;            /* Their compressed size */
+    atomic_long_t huge;             /* Incompressible pages kept as is */
+    atomic_long_t failed;           /* Pages that did not decompress */
+};
+
+/* Completion shaping, set through sysfs; limits are off when 0 */
+struct rb_shape {
+    u64 iops;                       /* Requests per second */
+    u64 bps;                        /* Bytes per second */
+    u64 burst_ns;                   /* Bucket depth, in time at the limit rate */
+    u64 latency_ns;                 /* Added latency, mean of latency_dist */
+    int latency_dist;               /* RB_LAT_* */
+    spinlock_t lock;                /* Protects the bucket times */
+    u64 iops_tat;                   /* Theoretical arrival time of each bucket */
+    u64 bps_tat;
+};
+
+/* A zone of a zoned device */
+struct rb_zone {
+    struct mutex lock;              /* Held over writes and state changes */
+    sector_t start;
+    sector_t len;                   /* Capacity too: zones are written to the end */
+    sector_t wp;                    /* Write pointer, -1 in conventional zones */
+    enum blk_zone_type type;
+    enum blk_zone_cond cond;
+};
+
+/* Hardware context data: requests of a poll queue wait here for ->poll */
+struct rb_queue {
+    spinlock_t poll_lock;
+    struct list_head poll_list;
+};
+
+/* Per-request data, after struct request */
+/* Part of a request copied by a worker of IO_par.c */
+struct rb_par_chunk {
+    struct work_struct work;
+    struct request *req;
+    struct bio *bio;                /* Bio and position the chunk starts at */
+    struct bvec_iter iter;
+    sector_t sector;
+    unsigned int bytes;
+};
+
+/* A transfer of a device keeping checksums, see IO_integ.c */
+struct rb_csum {
+    sector_t block;                 /* Block being summed */
+    u32 crc;                        /* ... over its first done bytes */
+    unsigned int done;
+    struct mutex *lock;             /* Region lock a write holds, NULL if none */
+    bool write;
+};
+
+struct t10_pi_tuple;
+
+struct rb_cmd {
+    blk_status_t status;            /* Result, held until polled or the timer */
+    u64 deadline;                   /* Shaped completion time, 0 if none */
+    struct hrtimer timer;           /* Completes shaped requests */
+    atomic_t pending;               /* Chunks not copied yet, or references on a file I/O */
+    int err;                        /* First error of a chunk, or of the file I/O */
+    unsigned int segs;
+    u64 start;                      /* Submission time */
+    struct kiocb iocb;              /* backing_file I/O */
+    struct bio_vec *bvec;           /* ... bio_vecs of a request of several bios */
+    struct rb_par_chunk par[];      /* par_threads of them, if set */
+};
+
+/* Peripheral's structure */
+struct rb_device {
+    int index;                      /* N in /dev/my_block_deviceN */
+    struct list_head list;          /* Entry in the module's device list */
+    sector_t size;                  /* Size of the device (in sectors) */
+    int major;
+    struct rb_layer *top;           /* Layer this device writes to */
+    struct xarray *pages;           /* Its pages, allocated on first write */
+    bool snapshot;                  /* Created by RB_IOC_SNAP_CREATE */
+    bool dying;                     /* Snapshot being deleted, under open_mutex */
+    spinlock_t slot_locks[RB_SLOT_LOCKS]; /* Serialize rewrites of an entry */
+    bool comp;                      /* Pages go through the compressor */
+    bool huge;                      /* New page ranges get a huge folio */
+    unsigned int par_threads;       /* Most chunks a request is cut in, 0 if off */
+    unsigned int par_bytes;         /* Smallest request cut in chunks */
+    unsigned int nt_bytes;          /* Smallest transfer copied with streaming stores, 0 if off */
+    struct rb_comp_stats comp_stats;
+    atomic_long_t same_pages;       /* Entries holding a fill word */
+    struct file *image;             /* image= file, NULL without one */
+    struct file *file;              /* backing_file=, serving all I/O, NULL without one */
+    unsigned int file_mem_align;    /* Its direct I/O buffer alignment */
+    unsigned long *image_loaded;    /* Pages whose image copy was dealt with */
+    struct mutex image_locks[RB_SLOT_LOCKS]; /* Serialize reads of the image */
+    atomic_long_t ram_pages;        /* Pages held by the top layer, plain store */
+    unsigned long tier_pages;       /* tier_ram_mb budget in pages, 0 if off */
+    unsigned long *tier_ref;        /* Clock bits: page used since the hand passed */
+    unsigned long tier_hand;        /* Next index the clock looks at */
+    struct work_struct tier_work;   /* Demotes down to the budget */
+    unsigned long *cache_dirty;     /* cache_dev: pages the lower device lacks, NULL if off */
+    unsigned long *cache_wb;        /* ... copied, on their way down */
+    atomic_long_t cache_dirty_pages;
+    struct delayed_work cache_work; /* Writes back cache_delay after the first dirty page */
+    unsigned long cache_delay;      /* cache_flush_ms, in jiffies */
+    struct mutex cache_flush_lock;  /* One write-back at a time, in cache_buf */
+    void *cache_buf;
+    unsigned int block_shift;       /* log2 of the logical block size */
+    u32 *csums;                     /* integrity: crc32c of each block, NULL if off */
+    u32 integ_zero;                 /* ... of a block of zeroes */
+    struct t10_pi_tuple *pi;        /* Protection tuple of each block, integrity=2 */
+    struct mutex integ_locks[RB_SLOT_LOCKS]; /* Serialize writes of a region */
+    struct work_struct scrub_work;
+    bool scrub_stop;
+    bool scrub_running;
+    unsigned long scrub_done;       /* Blocks checked by the current or last pass */
+    unsigned long scrub_errors;     /* ... not matching */
+    unsigned int scrub_passes;
+    bool blocking;                  /* I/O may sleep: no NOWAIT, blocking hctx */
+    struct rb_zone *zones;          /* zoned=1: every zone, NULL otherwise */
+    unsigned int nr_zones;
+    unsigned int zone_shift;        /* log2 of the zone size, in sectors */
+    struct miscdevice map_dev;      /* mmap_dev=1: char device mapping the pages */
+    char map_name[DISK_NAME_LEN + 8];
+    atomic_t map_users;             /* Opens of map_dev */
+    struct rb_shape shape;
+    int numa_policy;                /* RB_NUMA_* */
+    int node;                       /* Home node, NUMA_NO_NODE if unbound */
+    struct rb_stats __percpu *stats;
+    struct dentry *debugfs_dir;
+    struct blk_mq_tag_set tag_set;  /* Hardware contexts feeding our queue */
+    struct rb_queue *queues;        /* One per hardware context */
+    struct gendisk *rb_disk;        /* kernel's internal representation */
+};
+
+static inline bool rb_entry_is_obj(void *entry){
+    return xa_pointer_tag(entry) == RB_ENTRY_OBJ;
+}
+
+static inline struct rb_obj *rb_entry_obj(void *entry){
+    return xa_untag_pointer(entry);
+}
+
+static inline bool rb_entry_is_fill(void *entry){
+    return xa_pointer_tag(entry) == RB_ENTRY_FILL;
+}
+
+static inline unsigned long rb_entry_fill(void *entry){
+    return (long)entry >> 2;
+}
+
+static inline void *rb_mk_fill(unsigned long word){
+    return xa_tag_pointer((void *)(word << 2), RB_ENTRY_FILL);
+}
+
+/* The word loses its top 2 bits in the entry: they must match the next */
+static inline bool rb_fill_fits(unsigned long word){
+    return (unsigned long)((long)(word << 2) >> 2) == word;
+}
+
+/* True for entries reading back as zeroes */
+static inline bool rb_entry_is_zero(void *entry){
+    return !entry || (rb_entry_is_fill(entry) && !rb_entry_fill(entry));
+}
+
+static inline spinlock_t *rb_slot_lock(struct rb_device *rb_dev, unsigned long idx){
+    return &rb_dev->slot_locks[idx & (RB_SLOT_LOCKS - 1)];
+}
+
+/* IO_driver.c: copy and completion, shared with IO_par.c */
+int rb_do_bvec(struct rb_device *rb_dev, struct bio_vec *bv, sector_t sector, int write, struct rb_csum *cs, bool stream, gfp_t gfp);
+void rb_finish_rq(struct request *req, blk_status_t status, u64 start);
+
+/* IO_store.c: sparse page store behind the transfer functions */
+int rb_store_init(struct rb_device *rb_dev, struct rb_layer *base);
+void rb_store_free(struct rb_device *rb_dev);
+int rb_store_write(struct rb_device *rb_dev, const void *src, sector_t sector, unsigned int len, bool stream, gfp_t gfp);
+int rb_store_read(struct rb_device *rb_dev, void *dst, sector_t sector, unsigned int len, bool stream);
+int rb_store_discard(struct rb_device *rb_dev, sector_t sector, sector_t nr_sects, bool unmap, gfp_t gfp);
+int rb_store_node(struct rb_device *rb_dev, unsigned long idx);
+int rb_store_put(struct rb_device *rb_dev, unsigned long idx, const void *src, gfp_t gfp);
+struct page *rb_store_get_page(struct rb_device *rb_dev, unsigned long idx, gfp_t gfp);
+bool rb_store_copy_page(struct rb_device *rb_dev, unsigned long idx, void *buf);
+void rb_store_peek_page(struct rb_device *rb_dev, unsigned long idx, void *buf);
+void rb_store_evict(struct rb_device *rb_dev, unsigned long idx);
+void rb_entry_free(void *entry);
+void rb_fill_buf(void *dst, unsigned long word, unsigned int len);
+bool rb_same_filled(const void *src, unsigned long *word);
+int rb_nth_online_node(unsigned long nth);
+struct rb_layer *rb_store_split(struct rb_device *rb_dev);
+void rb_layer_put(struct rb_layer *layer);
+void *rb_base_load(struct rb_device *rb_dev, unsigned long idx);
+
+/* IO_comp.c: compressed pages, through the crypto API */
+int rb_comp_init(const char *algo);
+void rb_comp_exit(void);
+int rb_comp_write(struct rb_device *rb_dev, unsigned long idx, const void *src, unsigned int offset, unsigned int len, gfp_t gfp);
+int rb_comp_read(struct rb_device *rb_dev, unsigned long idx, void *dst, unsigned int offset, unsigned int len);
+void rb_comp_erase(struct rb_device *rb_dev, unsigned long idx);
+
+/* IO_image.c: image= persistence, restored lazily */
+int rb_image_open(struct rb_device *rb_dev, const char *path);
+void rb_image_close(struct rb_device *rb_dev, bool save);
+int rb_image_fault(struct rb_device *rb_dev, unsigned long idx, bool load);
+int rb_image_fault_locked(struct rb_device *rb_dev, unsigned long idx, bool load);
+int rb_image_drop_cache(struct rb_device *rb_dev);
+struct mutex *rb_image_lock(struct rb_device *rb_dev, unsigned long idx);
+
+/* IO_tier.c: RAM budget, cold pages demoted to the image */
+int rb_tier_init(struct rb_device *rb_dev, unsigned long pages);
+void rb_tier_free(struct rb_device *rb_dev);
+int rb_tier_enter(struct rb_device *rb_dev, unsigned long idx, bool load);
+void rb_tier_exit(struct rb_device *rb_dev, unsigned long idx);
+
+/* IO_cache.c: cache_dev=, write-back cache over a block device */
+int rb_cache_open(struct rb_device *rb_dev, const char *path, unsigned int flush_ms);
+void rb_cache_close(struct rb_device *rb_dev, bool save);
+void rb_cache_dirty(struct rb_device *rb_dev, unsigned long idx);
+void rb_cache_dirty_range(struct rb_device *rb_dev, sector_t start, sector_t end);
+void rb_cache_access(struct rb_device *rb_dev, unsigned long idx, bool load);
+bool rb_cache_busy(struct rb_device *rb_dev, unsigned long idx);
+bool rb_cache_clean(struct rb_device *rb_dev, unsigned long idx);
+int rb_cache_flush(struct rb_device *rb_dev);
+int rb_cache_fua(struct rb_device *rb_dev, sector_t sector, sector_t nr_sects);
+
+/* IO_map.c: char device mapping the backing pages */
+int rb_map_add(struct rb_device *rb_dev);
+void rb_map_remove(struct rb_device *rb_dev);
+
+/* IO_zoned.c: host-managed zone emulation */
+int rb_zoned_init(struct rb_device *rb_dev, sector_t zone_sectors, unsigned int nr_conv);
+void rb_zoned_free(struct rb_device *rb_dev);
+int rb_report_zones(struct gendisk *disk, sector_t sector, unsigned int nr_zones, report_zones_cb cb, void *data);
+int rb_zone_write_begin(struct rb_device *rb_dev, enum req_op op, sector_t *sector, sector_t nr);
+void rb_zone_write_end(struct rb_device *rb_dev, sector_t sector, sector_t nr, bool done);
+int rb_zone_mgmt(struct rb_device *rb_dev, enum req_op op, sector_t sector, gfp_t gfp);
+
+/* IO_integ.c: per-block checksums and protection information */
+int rb_integ_init(struct rb_device *rb_dev, int mode, unsigned int block_size);
+void rb_integ_free(struct rb_device *rb_dev);
+const char *rb_integ_algo(void);
+struct rb_csum *rb_integ_begin(struct rb_device *rb_dev, struct rb_csum *cs, sector_t sector, bool write);
+void rb_integ_end(struct rb_csum *cs);
+int rb_integ_copy(struct rb_device *rb_dev, struct rb_csum *cs, void *buf, sector_t sector, unsigned int len, bool stream, gfp_t gfp);
+int rb_integ_discard(struct rb_device *rb_dev, sector_t sector, sector_t nr_sects, bool unmap, gfp_t gfp);
+void rb_integ_pi(struct rb_device *rb_dev, struct request *req, sector_t sector);
+void rb_integ_scrub(struct rb_device *rb_dev);
+
+/* IO_file.c: backing_file=, async direct I/O */
+int rb_file_open(struct rb_device *rb_dev, const char *path, unsigned int block_size);
+void rb_file_close(struct rb_device *rb_dev);
+blk_status_t rb_file_submit(struct rb_device *rb_dev, struct request *req, u64 start);
+void rb_file_complete(struct request *req);
+
+/* IO_copy.c: streaming copies of bulk transfers */
+void rb_copy_init(void);
+const char *rb_copy_name(void);
+void rb_copy(void *dst, const void *src, size_t len, bool stream);
+void rb_copy_to_page(struct page *page, unsigned int offset, const void *src, unsigned int len, bool stream);
+void rb_copy_from_page(void *dst, struct page *page, unsigned int offset, unsigned int len, bool stream);
+
+/* True if a transfer of bytes is to be copied with streaming stores */
+static inline bool rb_copy_stream(struct rb_device *rb_dev, unsigned int bytes){
+    unsigned int threshold = READ_ONCE(rb_dev->nt_bytes);
+    return threshold && bytes >= threshold;
+}
+
+/* IO_par.c: large requests copied by several CPUs */
+int rb_par_init(void);
+void rb_par_exit(void);
+unsigned int rb_par_chunks(struct rb_device *rb_dev, struct request *req);
+void rb_par_submit(struct rb_device *rb_dev, struct request *req, unsigned int nr, u64 start);
+
+/* IO_shape.c: token buckets and added latency on completions */
+void rb_shape_init(struct rb_device *rb_dev);
+void rb_shape_reset(struct rb_device *rb_dev);
+u64 rb_shape_deadline(struct rb_device *rb_dev, unsigned int bytes, u64 now);
+
+/* IO_stats.c: counters and histograms, exported in debugfs */
+void rb_stats_account(struct rb_device *rb_dev, enum req_op op, unsigned int bytes, unsigned int segs, u64 ns);
+void rb_stats_sum(struct rb_device *rb_dev, struct rb_stats *sum);
+void rb_debugfs_init(const char *name);
+void rb_debugfs_exit(void);
+void rb_debugfs_add(struct rb_device *rb_dev);
+void rb_debugfs_remove(struct rb_device *rb_dev);
+
+/* IO_sysfs.c: attributes under /sys/block/<disk>/ramdisk */
+extern const struct attribute_group *rb_disk_groups[];
+
+#endif
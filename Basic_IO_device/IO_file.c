@@ -0,0 +1,190 @@
+/* backing_file= mode: the disk fronts a regular file, like loop with
+ * direct I/O, without a copy in our pages nor in the page cache. Reads
+ * and writes are issued from queue_rq as asynchronous O_DIRECT kiocbs
+ * over the request's own bio_vecs, as many in flight as the queue has
+ * tags; the file system's completion ends the request through
+ * blk_mq_complete_request(), on the CPU that submitted it. Flushes,
+ * discards and write-zeroes are served inline by the file system. */
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/file.h>
+#include <linux/falloc.h>
+#include <linux/stat.h>
+#include <linux/uio.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/slab.h>
+#include <linux/ktime.h>
+#include <linux/printk.h>
+
+#include "IO_driver.h"
+
+/* Open path for a device of block_size byte blocks; a new or empty file
+ * is sized to the device, one of another size is refused */
+int rb_file_open(struct rb_device *rb_dev, const char *path, unsigned int block_size){
+    loff_t dev_size = (loff_t)rb_dev->size << SECTOR_SHIFT;
+    struct file *file;
+    struct kstat stat;
+    unsigned int offset_align = KERNEL_SECTOR_SIZE;
+    loff_t size;
+    int status;
+    /* fails on file systems without direct I/O */
+    file = filp_open(path, O_RDWR | O_CREAT | O_LARGEFILE | O_DIRECT, 0600);
+    if(IS_ERR(file)){
+        printk(KERN_ERR "Unable to open backing file %s for direct I/O\n",path);
+        return PTR_ERR(file);
+    }
+    status = -EINVAL;
+    if(!S_ISREG(file_inode(file)->i_mode)){
+        printk(KERN_ERR "Backing file %s is not a regular file\n",path);
+        goto out;
+    }
+    size = i_size_read(file_inode(file));
+    if(size && size != dev_size){
+        printk(KERN_ERR "Backing file %s holds %lld bytes, the device %lld\n",path, size, dev_size);
+        goto out;
+    }
+    /* blocks and buffers must meet the file system's direct I/O alignment */
+    rb_dev->file_mem_align = KERNEL_SECTOR_SIZE;
+    if(!vfs_getattr(&file->f_path, &stat, STATX_DIOALIGN, AT_STATX_SYNC_AS_STAT) && stat.result_mask & STATX_DIOALIGN){
+        offset_align = stat.dio_offset_align;
+        rb_dev->file_mem_align = max_t(unsigned int, stat.dio_mem_align, rb_dev->file_mem_align);
+    }else if(file_inode(file)->i_sb->s_bdev){
+        offset_align = bdev_logical_block_size(file_inode(file)->i_sb->s_bdev);
+    }
+    if(!offset_align || block_size < offset_align){
+        printk(KERN_ERR "Backing file %s needs %u byte aligned direct I/O, logical_block_size is %u\n",path, offset_align, block_size);
+        goto out;
+    }
+    if(!size){
+        status = vfs_truncate(&file->f_path, dev_size);
+        if(status)
+            goto out;
+    }
+    rb_dev->file = file;
+    printk(KERN_INFO "Device %d: %s backing file %s\n",rb_dev->index, size ? "existing" : "new", path);
+    return 0;
+out:
+    filp_close(file, NULL);
+    return status;
+}
+
+void rb_file_close(struct rb_device *rb_dev){
+    if(!rb_dev->file)
+        return;
+    filp_close(rb_dev->file, NULL);
+    rb_dev->file = NULL;
+}
+
+/* Drop a reference on the request's I/O: the submitter's, then the
+ * file system's once it completed */
+static void rb_file_put(struct rb_cmd *cmd){
+    if(!atomic_dec_and_test(&cmd->pending))
+        return;
+    kfree(cmd->bvec);
+    cmd->bvec = NULL;
+    blk_mq_complete_request(blk_mq_rq_from_pdu(cmd));
+}
+
+static void rb_file_aio_complete(struct kiocb *iocb, long ret){
+    struct rb_cmd *cmd = container_of(iocb, struct rb_cmd, iocb);
+    struct request *req = blk_mq_rq_from_pdu(cmd);
+    /* the file is as large as the device, nothing is short but errors */
+    if(ret < 0)
+        cmd->err = ret;
+    else if(ret != blk_rq_bytes(req))
+        cmd->err = -EIO;
+    else
+        cmd->err = 0;
+    rb_file_put(cmd);
+}
+
+/* Read or write req at pos, over its bio_vecs: in place for a single
+ * bio, gathered in an array otherwise */
+static blk_status_t rb_file_rw(struct rb_device *rb_dev, struct request *req, loff_t pos){
+    struct rb_cmd *cmd = blk_mq_rq_to_pdu(req);
+    struct file *file = rb_dev->file;
+    int dir = req_op(req) == REQ_OP_WRITE ? ITER_SOURCE : ITER_DEST;
+    struct req_iterator it;
+    struct bio_vec bv, *bvec;
+    struct iov_iter iter;
+    unsigned int offset = 0, nr = 0;
+    ssize_t ret;
+    rq_for_each_bvec(bv, req, it)
+        nr++;
+    if(req->bio != req->biotail){
+        bvec = kmalloc_array(nr, sizeof(*bvec), GFP_NOIO);
+        if(!bvec)
+            return BLK_STS_RESOURCE;
+        cmd->bvec = bvec;
+        rq_for_each_bvec(bv, req, it)
+            *bvec++ = bv;
+        bvec = cmd->bvec;
+    }else{
+        offset = req->bio->bi_iter.bi_bvec_done;
+        bvec = __bvec_iter_bvec(req->bio->bi_io_vec, req->bio->bi_iter);
+    }
+    cmd->segs = nr;
+    iov_iter_bvec(&iter, dir, bvec, nr, blk_rq_bytes(req));
+    iter.iov_offset = offset;
+    /* one reference for us, one for the completion */
+    atomic_set(&cmd->pending, 2);
+    cmd->iocb.ki_pos = pos;
+    cmd->iocb.ki_filp = file;
+    cmd->iocb.ki_complete = rb_file_aio_complete;
+    cmd->iocb.ki_flags = IOCB_DIRECT;
+    cmd->iocb.ki_ioprio = req_get_ioprio(req);
+    if(req->cmd_flags & REQ_FUA)
+        cmd->iocb.ki_flags |= IOCB_DSYNC;
+    if(dir == ITER_SOURCE)
+        ret = file->f_op->write_iter(&cmd->iocb, &iter);
+    else
+        ret = file->f_op->read_iter(&cmd->iocb, &iter);
+    /* done already, or failed before going async */
+    if(ret != -EIOCBQUEUED)
+        rb_file_aio_complete(&cmd->iocb, ret);
+    rb_file_put(cmd);
+    return BLK_STS_OK;
+}
+
+/* Start req, checked, on the backing file; it ends in rb_file_complete(),
+ * unless BLK_STS_RESOURCE asks the block layer to try again */
+blk_status_t rb_file_submit(struct rb_device *rb_dev, struct request *req, u64 start){
+    struct rb_cmd *cmd = blk_mq_rq_to_pdu(req);
+    loff_t pos = (loff_t)blk_rq_pos(req) << SECTOR_SHIFT;
+    int mode;
+    cmd->start = start;
+    cmd->segs = 0;
+    cmd->bvec = NULL;
+    switch(req_op(req)){
+    case REQ_OP_READ:
+    case REQ_OP_WRITE:
+        return rb_file_rw(rb_dev, req, pos);
+    case REQ_OP_FLUSH:
+        cmd->err = vfs_fsync(rb_dev->file, 0);
+        break;
+    case REQ_OP_DISCARD:
+    case REQ_OP_WRITE_ZEROES:
+        /* holes read as zeroes; REQ_NOUNMAP keeps the blocks allocated */
+        mode = FALLOC_FL_PUNCH_HOLE;
+        if(req_op(req) == REQ_OP_WRITE_ZEROES && req->cmd_flags & REQ_NOUNMAP)
+            mode = FALLOC_FL_ZERO_RANGE;
+        cmd->err = vfs_fallocate(rb_dev->file, mode | FALLOC_FL_KEEP_SIZE, pos, blk_rq_bytes(req));
+        break;
+    default:
+        cmd->err = -EOPNOTSUPP;
+        break;
+    }
+    atomic_set(&cmd->pending, 1);
+    rb_file_put(cmd);
+    return BLK_STS_OK;
+}
+
+/* blk-mq completion of a request served by the file */
+void rb_file_complete(struct request *req){
+    struct rb_cmd *cmd = blk_mq_rq_to_pdu(req);
+    if(!cmd->err)
+        rb_stats_account(req->q->queuedata, req_op(req), blk_rq_bytes(req), cmd->segs, ktime_get_ns() - cmd->start);
+    rb_finish_rq(req, errno_to_blk_status(cmd->err), cmd->start);
+}
@@ -0,0 +1,223 @@
+/* image= persistence: the store is written back to a file (or block
+ * device) on unload and taken back page by page on first access after
+ * the next load, so a warm restart does not wait for the whole image to
+ * be read. With tier_ram_mb, IO_tier.c also sends cold pages there.
+ * image_loaded has a bit per page once its copy in the file is no longer
+ * needed: read in, overwritten, discarded, or absent from a new image. */
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/file.h>
+#include <linux/falloc.h>
+#include <linux/mm.h>
+#include <linux/pagemap.h>
+#include <linux/gfp.h>
+#include <linux/slab.h>
+#include <linux/bitops.h>
+#include <linux/bitmap.h>
+#include <linux/mutex.h>
+#include <linux/sched.h>
+#include <linux/printk.h>
+#include <linux/xarray.h>
+
+#include "IO_driver.h"
+
+static unsigned long rb_nr_pages(struct rb_device *rb_dev){
+    return DIV_ROUND_UP(rb_dev->size, PAGE_SECTORS);
+}
+
+int rb_image_open(struct rb_device *rb_dev, const char *path){
+    unsigned long nr_pages = rb_nr_pages(rb_dev);
+    loff_t dev_size = (loff_t)rb_dev->size << SECTOR_SHIFT;
+    struct file *file;
+    loff_t size;
+    bool bdev;
+    int i, status;
+    file = filp_open(path, O_RDWR | O_CREAT | O_LARGEFILE, 0600);
+    if(IS_ERR(file)){
+        printk(KERN_ERR "Unable to open image %s\n",path);
+        return PTR_ERR(file);
+    }
+    bdev = S_ISBLK(file_inode(file)->i_mode);
+    if(!bdev && !S_ISREG(file_inode(file)->i_mode)){
+        printk(KERN_ERR "Image %s is neither a file nor a block device\n",path);
+        filp_close(file, NULL);
+        return -EINVAL;
+    }
+    /* the device node's own size is 0, the block device's is on its mapping */
+    size = i_size_read(file->f_mapping->host);
+    if(bdev ? size < dev_size : size && size != dev_size){
+        printk(KERN_ERR "Image %s holds %lld bytes, the device %lld\n",path, size, dev_size);
+        filp_close(file, NULL);
+        return -EINVAL;
+    }
+    rb_dev->image_loaded = kvcalloc(BITS_TO_LONGS(nr_pages), sizeof(unsigned long), GFP_KERNEL);
+    if(!rb_dev->image_loaded){
+        filp_close(file, NULL);
+        return -ENOMEM;
+    }
+    /* a new image has nothing to bring back; sized now, pages may be
+     * demoted to it in any order */
+    if(!size){
+        bitmap_fill(rb_dev->image_loaded, nr_pages);
+        status = vfs_truncate(&file->f_path, dev_size);
+        if(status){
+            kvfree(rb_dev->image_loaded);
+            rb_dev->image_loaded = NULL;
+            filp_close(file, NULL);
+            return status;
+        }
+    }
+    for(i = 0; i < RB_SLOT_LOCKS; ++i)
+        mutex_init(&rb_dev->image_locks[i]);
+    rb_dev->image = file;
+    printk(KERN_INFO "Device %d: %s image %s\n",rb_dev->index, size ? "restoring lazily from" : "new", path);
+    return 0;
+}
+
+struct mutex *rb_image_lock(struct rb_device *rb_dev, unsigned long idx){
+    return &rb_dev->image_locks[idx & (RB_SLOT_LOCKS - 1)];
+}
+
+/* rb_image_fault() with the page's image lock held */
+int rb_image_fault_locked(struct rb_device *rb_dev, unsigned long idx, bool load){
+    loff_t pos = (loff_t)idx << PAGE_SHIFT;
+    unsigned long word;
+    ssize_t done;
+    void *buf;
+    int err = 0;
+    if(test_bit(idx, rb_dev->image_loaded))
+        return 0;
+    if(load){
+        buf = kmalloc(PAGE_SIZE, GFP_NOIO);
+        if(!buf)
+            return -ENOMEM;
+        done = kernel_read(rb_dev->image, buf, PAGE_SIZE, &pos);
+        if(done < 0){
+            err = done;
+        }else{
+            memset(buf + done, 0, PAGE_SIZE - done);
+            /* holes stay out of the store */
+            if(!rb_same_filled(buf, &word) || word)
+                err = rb_store_put(rb_dev, idx, buf, GFP_NOIO);
+        }
+        kfree(buf);
+        if(err)
+            return err;
+    }
+    /* the page is in the store before anyone sees the bit */
+    smp_mb__before_atomic();
+    set_bit(idx, rb_dev->image_loaded);
+    return 0;
+}
+
+/* Write back and drop the image's page cache, filled by demotions and
+ * fault reads: with tier_ram_mb the pages are meant to leave RAM */
+int rb_image_drop_cache(struct rb_device *rb_dev){
+    struct address_space *mapping = rb_dev->image->f_mapping;
+    int err;
+    err = filemap_write_and_wait(mapping);
+    invalidate_mapping_pages(mapping, 0, -1);
+    return err;
+}
+
+/* Take in page idx from the image before it is first used; with load
+ * false the caller replaces or drops the page, only the bit is set */
+int rb_image_fault(struct rb_device *rb_dev, unsigned long idx, bool load){
+    struct mutex *lock = rb_image_lock(rb_dev, idx);
+    int err;
+    if(test_bit_acquire(idx, rb_dev->image_loaded))
+        return 0;
+    mutex_lock(lock);
+    err = rb_image_fault_locked(rb_dev, idx, load);
+    mutex_unlock(lock);
+    return err;
+}
+
+/* Punch [first, end) pages out of the image, or write zeroes if the
+ * filesystem cannot */
+static int rb_image_hole(struct rb_device *rb_dev, unsigned long first, unsigned long end, void *zero){
+    loff_t pos = (loff_t)first << PAGE_SHIFT;
+    ssize_t done;
+    int err;
+    if(first >= end)
+        return 0;
+    err = vfs_fallocate(rb_dev->image, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pos, (loff_t)(end - first) << PAGE_SHIFT);
+    if(err != -EOPNOTSUPP)
+        return err;
+    memset(zero, 0, PAGE_SIZE);
+    for(; first < end; ++first){
+        done = kernel_write(rb_dev->image, zero, PAGE_SIZE, &pos);
+        if(done != PAGE_SIZE)
+            return done < 0 ? done : -EIO;
+    }
+    return 0;
+}
+
+/* Write back the pages taken in or changed since load, pages never
+ * touched are still right in the file */
+static int rb_image_save(struct rb_device *rb_dev){
+    unsigned long nr_pages = rb_nr_pages(rb_dev);
+    unsigned long idx, hole = 0, hole_end = 0, saved = 0;
+    loff_t pos, size = (loff_t)rb_dev->size << SECTOR_SHIFT;
+    ssize_t done;
+    void *buf, *entry;
+    int err;
+    buf = kmalloc(PAGE_SIZE, GFP_KERNEL);
+    if(!buf)
+        return -ENOMEM;
+    /* block devices have the size they have */
+    if(S_ISREG(file_inode(rb_dev->image)->i_mode)){
+        err = vfs_truncate(&rb_dev->image->f_path, size);
+        if(err)
+            goto out;
+    }
+    for_each_set_bit(idx, rb_dev->image_loaded, nr_pages){
+        entry = xa_load(rb_dev->pages, idx);
+        if(rb_entry_is_zero(entry)){
+            /* grow the current run of holes, or start another */
+            if(idx != hole_end){
+                err = rb_image_hole(rb_dev, hole, hole_end, buf);
+                if(err)
+                    goto out;
+                hole = idx;
+            }
+            hole_end = idx + 1;
+            continue;
+        }
+        err = rb_store_read(rb_dev, buf, (sector_t)idx << PAGE_SECTORS_SHIFT, PAGE_SIZE, false);
+        if(err)
+            goto out;
+        pos = (loff_t)idx << PAGE_SHIFT;
+        done = kernel_write(rb_dev->image, buf, PAGE_SIZE, &pos);
+        if(done != PAGE_SIZE){
+            err = done < 0 ? done : -EIO;
+            goto out;
+        }
+        saved++;
+        cond_resched();
+    }
+    err = rb_image_hole(rb_dev, hole, hole_end, buf);
+    if(!err)
+        err = vfs_fsync(rb_dev->image, 0);
+    if(!err)
+        printk(KERN_INFO "Device %d: %lu pages saved to %pD\n",rb_dev->index, saved, rb_dev->image);
+out:
+    kfree(buf);
+    return err;
+}
+
+/* Save with save set, then let the file go */
+void rb_image_close(struct rb_device *rb_dev, bool save){
+    int err;
+    if(!rb_dev->image)
+        return;
+    if(save){
+        err = rb_image_save(rb_dev);
+        if(err)
+            printk(KERN_ERR "Saving image %pD failed: %d\n",rb_dev->image, err);
+    }
+    filp_close(rb_dev->image, NULL);
+    rb_dev->image = NULL;
+    kvfree(rb_dev->image_loaded);
+    rb_dev->image_loaded = NULL;
+}
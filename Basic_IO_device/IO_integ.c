@@ -0,0 +1,346 @@
+/* integrity=1: a crc32c of each logical block, set as it is written and
+ * checked as it is read, and by a scrub pass started from sysfs. The
+ * crc32c library picks the SSE4.2/PCLMUL implementation where there is
+ * one. Writes and discards hold the lock of the 64 KiB region they are in
+ * over the copy and the checksum update; a write is summed from the store
+ * once copied, and the disk asks for stable pages. Reads are not locked,
+ * a block found not matching is checked again under its lock, the data
+ * having possibly been caught halfway through a write. integrity=2 also gives
+ * the disk a T10-PI profile: the block layer generates and checks the
+ * tuples, which are kept next to the checksums and read back as given. */
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/workqueue.h>
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 14, 0)
+#include <linux/crc32c.h>
+#else
+#include <linux/crc32.h>
+#endif
+#include <linux/t10-pi.h>
+#include <linux/bio.h>
+#include <linux/printk.h>
+
+#include "IO_driver.h"
+
+#define RB_INTEG_REGION (64 * 1024 / KERNEL_SECTOR_SIZE)    /* sectors under one lock */
+
+static unsigned int rb_block_sectors_shift(struct rb_device *rb_dev){
+    return rb_dev->block_shift - SECTOR_SHIFT;
+}
+
+static struct mutex *rb_integ_lock(struct rb_device *rb_dev, sector_t sector){
+    return &rb_dev->integ_locks[(sector / RB_INTEG_REGION) & (RB_SLOT_LOCKS - 1)];
+}
+
+/* Implementation the crc32c library uses; 6.14 dropped crc32c_impl()
+ * for a flag of whether it is optimized */
+const char *rb_integ_algo(void){
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 14, 0)
+    return crc32c_impl();
+#else
+    return crc32_optimizations() & CRC32C_OPTIMIZATION ? "crc32c-arch" : "crc32c-generic";
+#endif
+}
+
+/* crc32c of block as the store holds it now, a sector at a time */
+static int rb_integ_sum_store(struct rb_device *rb_dev, sector_t block, u32 *crc){
+    sector_t sector = block << rb_block_sectors_shift(rb_dev);
+    u8 buf[KERNEL_SECTOR_SIZE];
+    unsigned int i;
+    int err;
+    *crc = ~0;
+    for(i = 0; i < 1U << rb_block_sectors_shift(rb_dev); ++i){
+        err = rb_store_read(rb_dev, buf, sector + i, sizeof(buf), false);
+        if(err)
+            return err;
+        *crc = crc32c(*crc, buf, sizeof(buf));
+    }
+    return 0;
+}
+
+/* Sum the blocks in [first, last] again from the store, after a write or
+ * discard that failed halfway; their region lock is held */
+static void rb_integ_resum(struct rb_device *rb_dev, sector_t first, sector_t last){
+    u32 crc;
+    for(; first <= last; ++first){
+        if(!rb_integ_sum_store(rb_dev, first, &crc))
+            WRITE_ONCE(rb_dev->csums[first], crc);
+    }
+}
+
+/* A read found block not matching: look again with writers kept out */
+static int rb_integ_recheck(struct rb_device *rb_dev, sector_t block){
+    struct mutex *lock = rb_integ_lock(rb_dev, block << rb_block_sectors_shift(rb_dev));
+    u32 crc;
+    int err;
+    this_cpu_inc(rb_dev->stats->integ_rechecked);
+    mutex_lock(lock);
+    err = rb_integ_sum_store(rb_dev, block, &crc);
+    if(!err && crc != rb_dev->csums[block])
+        err = -EILSEQ;
+    mutex_unlock(lock);
+    if(err == -EILSEQ){
+        this_cpu_inc(rb_dev->stats->integ_errors);
+        printk_ratelimited(KERN_ERR "Device %d: block %llu does not match its checksum\n",rb_dev->index, (unsigned long long)block);
+    }
+    return err;
+}
+
+/* Start a transfer at sector; NULL if the device keeps no checksums */
+struct rb_csum *rb_integ_begin(struct rb_device *rb_dev, struct rb_csum *cs, sector_t sector, bool write){
+    if(!rb_dev->csums)
+        return NULL;
+    cs->block = sector >> rb_block_sectors_shift(rb_dev);
+    cs->crc = ~0;
+    cs->done = 0;
+    cs->lock = NULL;
+    cs->write = write;
+    return cs;
+}
+
+void rb_integ_end(struct rb_csum *cs){
+    if(cs && cs->lock)
+        mutex_unlock(cs->lock);
+}
+
+/* Add len bytes of buf to the transfer's running sum, setting or checking
+ * the checksum of each block it completes */
+static int rb_integ_sum(struct rb_device *rb_dev, struct rb_csum *cs, const void *buf, unsigned int len){
+    unsigned int size = 1U << rb_dev->block_shift, part;
+    int err;
+    while(len){
+        part = min(len, size - cs->done);
+        cs->crc = crc32c(cs->crc, buf, part);
+        cs->done += part;
+        buf += part;
+        len -= part;
+        if(cs->done < size)
+            break;
+        if(cs->write){
+            WRITE_ONCE(rb_dev->csums[cs->block], cs->crc);
+        }else{
+            this_cpu_inc(rb_dev->stats->integ_verified);
+            if(cs->crc != READ_ONCE(rb_dev->csums[cs->block])){
+                err = rb_integ_recheck(rb_dev, cs->block);
+                if(err)
+                    return err;
+            }
+        }
+        cs->block++;
+        cs->crc = ~0;
+        cs->done = 0;
+    }
+    return 0;
+}
+
+/* Take the lock of sector's region for a write, dropping the one held */
+static void rb_integ_relock(struct rb_device *rb_dev, struct rb_csum *cs, sector_t sector){
+    struct mutex *lock = rb_integ_lock(rb_dev, sector);
+    if(lock == cs->lock)
+        return;
+    if(cs->lock)
+        mutex_unlock(cs->lock);
+    mutex_lock(lock);
+    cs->lock = lock;
+}
+
+/* Add the len bytes just written at sector to the transfer's sum, as the
+ * store holds them: the caller's buffer may change once copied */
+static int rb_integ_sum_written(struct rb_device *rb_dev, struct rb_csum *cs, sector_t sector, unsigned int len){
+    u8 buf[KERNEL_SECTOR_SIZE];
+    unsigned int part;
+    int err;
+    for(; len; len -= part, ++sector){
+        part = min_t(unsigned int, len, sizeof(buf));
+        err = rb_store_read(rb_dev, buf, sector, part, false);
+        if(!err)
+            err = rb_integ_sum(rb_dev, cs, buf, part);
+        if(err)
+            return err;
+    }
+    return 0;
+}
+
+/* Copy len bytes between buf and the store at sector, a region at a time */
+int rb_integ_copy(struct rb_device *rb_dev, struct rb_csum *cs, void *buf, sector_t sector, unsigned int len, bool stream, gfp_t gfp){
+    unsigned int shift = rb_block_sectors_shift(rb_dev), chunk;
+    sector_t next;
+    int err;
+    while(len){
+        next = round_down(sector, RB_INTEG_REGION) + RB_INTEG_REGION;
+        chunk = min_t(sector_t, len, (next - sector) << SECTOR_SHIFT);
+        if(cs->write){
+            rb_integ_relock(rb_dev, cs, sector);
+            err = rb_store_write(rb_dev, buf, sector, chunk, stream, gfp);
+            if(!err)
+                err = rb_integ_sum_written(rb_dev, cs, sector, chunk);
+            if(err){
+                rb_integ_resum(rb_dev, sector >> shift, (sector + (chunk >> SECTOR_SHIFT) - 1) >> shift);
+                return err;
+            }
+        }else{
+            err = rb_store_read(rb_dev, buf, sector, chunk, stream);
+            if(!err)
+                err = rb_integ_sum(rb_dev, cs, buf, chunk);
+            if(err)
+                return err;
+        }
+        buf += chunk;
+        sector += chunk >> SECTOR_SHIFT;
+        len -= chunk;
+    }
+    return 0;
+}
+
+/* The blocks of [sector, sector + nr_sects) now read as zeroes */
+static void rb_integ_reset(struct rb_device *rb_dev, sector_t sector, sector_t nr_sects){
+    unsigned int shift = rb_block_sectors_shift(rb_dev);
+    sector_t first = sector >> shift, nr = nr_sects >> shift;
+    memset32(&rb_dev->csums[first], rb_dev->integ_zero, nr);
+    if(rb_dev->pi)
+        memset(&rb_dev->pi[first], 0xff, nr * sizeof(*rb_dev->pi));
+}
+
+/* rb_store_discard(), a region at a time under its lock */
+int rb_integ_discard(struct rb_device *rb_dev, sector_t sector, sector_t nr_sects, bool unmap, gfp_t gfp){
+    unsigned int shift = rb_block_sectors_shift(rb_dev);
+    sector_t end = sector + nr_sects, next;
+    struct mutex *lock;
+    int err = 0;
+    if(!rb_dev->csums)
+        return rb_store_discard(rb_dev, sector, nr_sects, unmap, gfp);
+    for(; sector < end && !err; sector = next){
+        next = min_t(sector_t, end, round_down(sector, RB_INTEG_REGION) + RB_INTEG_REGION);
+        lock = rb_integ_lock(rb_dev, sector);
+        mutex_lock(lock);
+        err = rb_store_discard(rb_dev, sector, next - sector, unmap, gfp);
+        if(err)
+            rb_integ_resum(rb_dev, sector >> shift, (next - 1) >> shift);
+        else
+            rb_integ_reset(rb_dev, sector, next - sector);
+        mutex_unlock(lock);
+        cond_resched();
+    }
+    return err;
+}
+
+/* integrity=2: copy the protection tuples of req's bios, starting at
+ * sector, to or from the device's. Bios written without any, the block
+ * layer being told not to generate them, leave the escape tuple that
+ * reads do not check. */
+void rb_integ_pi(struct rb_device *rb_dev, struct request *req, sector_t sector){
+    unsigned int shift = rb_block_sectors_shift(rb_dev);
+    struct bio_integrity_payload *bip;
+    struct bvec_iter iter;
+    struct bio_vec bv;
+    struct bio *bio;
+    u8 *pi, *addr;
+    if(!rb_dev->pi)
+        return;
+    __rq_for_each_bio(bio, req){
+        pi = (u8 *)&rb_dev->pi[sector >> shift];
+        bip = bio_integrity(bio);
+        if(!bip){
+            if(op_is_write(bio_op(bio)))
+                memset(pi, 0xff, (bio_sectors(bio) >> shift) * sizeof(*rb_dev->pi));
+        }else{
+            bip_for_each_vec(bv, bip, iter){
+                addr = bvec_kmap_local(&bv);
+                if(op_is_write(bio_op(bio)))
+                    memcpy(pi, addr, bv.bv_len);
+                else
+                    memcpy(addr, pi, bv.bv_len);
+                kunmap_local(addr);
+                pi += bv.bv_len;
+            }
+        }
+        sector += bio_sectors(bio);
+    }
+}
+
+/* Check every block against its checksum, a page at a time */
+static void rb_scrub_work(struct work_struct *work){
+    struct rb_device *rb_dev = container_of(work, struct rb_device, scrub_work);
+    unsigned int shift = rb_block_sectors_shift(rb_dev), size = 1U << rb_dev->block_shift;
+    unsigned long nr_blocks = rb_dev->size >> shift, block, i, n;
+    struct mutex *lock;
+    sector_t sector;
+    void *buf;
+    int err = 0;
+    buf = kmalloc(PAGE_SIZE, GFP_KERNEL);
+    if(!buf)
+        return;
+    WRITE_ONCE(rb_dev->scrub_running, true);
+    WRITE_ONCE(rb_dev->scrub_done, 0);
+    WRITE_ONCE(rb_dev->scrub_errors, 0);
+    for(block = 0; block < nr_blocks && !READ_ONCE(rb_dev->scrub_stop) && !err; block += n){
+        n = min(PAGE_SIZE / size, nr_blocks - block);
+        sector = (sector_t)block << shift;
+        lock = rb_integ_lock(rb_dev, sector);
+        mutex_lock(lock);
+        err = rb_store_read(rb_dev, buf, sector, n * size, false);
+        for(i = 0; i < n && !err; ++i){
+            if(crc32c(~0, buf + i * size, size) == rb_dev->csums[block + i])
+                continue;
+            WRITE_ONCE(rb_dev->scrub_errors, rb_dev->scrub_errors + 1);
+            printk_ratelimited(KERN_ERR "Device %d: scrub: block %lu does not match its checksum\n",rb_dev->index, block + i);
+        }
+        mutex_unlock(lock);
+        WRITE_ONCE(rb_dev->scrub_done, block + n);
+        cond_resched();
+    }
+    if(err)
+        printk(KERN_ERR "Device %d: scrub stopped at block %lu: %d\n",rb_dev->index, block, err);
+    rb_dev->scrub_passes++;
+    WRITE_ONCE(rb_dev->scrub_running, false);
+    kfree(buf);
+}
+
+/* Start a scrub pass, unless one is already on its way */
+void rb_integ_scrub(struct rb_device *rb_dev){
+    if(rb_dev->csums)
+        queue_work(system_unbound_wq, &rb_dev->scrub_work);
+}
+
+/* Every block starts with the checksum of zeroes, and the escape tuple */
+int rb_integ_init(struct rb_device *rb_dev, int mode, unsigned int block_size){
+    unsigned long nr_blocks;
+    unsigned int i;
+    rb_dev->block_shift = ilog2(block_size);
+    nr_blocks = rb_dev->size >> rb_block_sectors_shift(rb_dev);
+    rb_dev->csums = kvmalloc_array(nr_blocks, sizeof(*rb_dev->csums), GFP_KERNEL);
+    if(!rb_dev->csums)
+        return -ENOMEM;
+    if(mode == RB_INTEG_PI){
+        rb_dev->pi = kvmalloc_array(nr_blocks, sizeof(*rb_dev->pi), GFP_KERNEL);
+        if(!rb_dev->pi){
+            kvfree(rb_dev->csums);
+            rb_dev->csums = NULL;
+            return -ENOMEM;
+        }
+        memset(rb_dev->pi, 0xff, nr_blocks * sizeof(*rb_dev->pi));
+    }
+    rb_dev->integ_zero = crc32c(~0, page_address(ZERO_PAGE(0)), block_size);
+    memset32(rb_dev->csums, rb_dev->integ_zero, nr_blocks);
+    for(i = 0; i < RB_SLOT_LOCKS; ++i)
+        mutex_init(&rb_dev->integ_locks[i]);
+    INIT_WORK(&rb_dev->scrub_work, rb_scrub_work);
+    printk(KERN_INFO "Device %d: crc32c (%s) of each %u byte block%s\n",rb_dev->index, rb_integ_algo(), block_size,
+           rb_dev->pi ? ", T10-PI profile" : "");
+    return 0;
+}
+
+void rb_integ_free(struct rb_device *rb_dev){
+    if(!rb_dev->csums)
+        return;
+    WRITE_ONCE(rb_dev->scrub_stop, true);
+    cancel_work_sync(&rb_dev->scrub_work);
+    kvfree(rb_dev->pi);
+    rb_dev->pi = NULL;
+    kvfree(rb_dev->csums);
+    rb_dev->csums = NULL;
+}
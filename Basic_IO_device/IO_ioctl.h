@@ -0,0 +1,24 @@
+/* ioctls of the ramdisk, shared with user space */
+#ifndef IO_IOCTL_H
+#define IO_IOCTL_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define RB_IOC_MAGIC 0xB4
+
+/* Snapshot the disk the ioctl is issued on: returns the index N of the
+ * new /dev/my_block_deviceN, sharing its pages until either side writes */
+#define RB_IOC_SNAP_CREATE _IOR(RB_IOC_MAGIC, 1, __u32)
+/* Delete the snapshot of index N, which must not be open */
+#define RB_IOC_SNAP_DELETE _IOW(RB_IOC_MAGIC, 2, __u32)
+
+/* On /dev/my_block_deviceN_mmap. Stores through the mapping land in the
+ * device at once; block I/O only meets them after RB_IOC_MAP_FLUSH, which
+ * drops the block device's page cache. RB_IOC_MAP_INVALIDATE writes the
+ * page cache back and unmaps every page, so the next access maps what
+ * block writes, discards and resets left in the device. */
+#define RB_IOC_MAP_FLUSH _IO(RB_IOC_MAGIC, 3)
+#define RB_IOC_MAP_INVALIDATE _IO(RB_IOC_MAGIC, 4)
+
+#endif
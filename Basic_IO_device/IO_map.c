@@ -0,0 +1,110 @@
+/* mmap_dev=1: /dev/<disk>_mmap maps the backing pages themselves, so a
+ * producer fills or scans the device with plain loads and stores instead
+ * of going through the block device's page cache and the transfer copy.
+ * Faults hand out the store's pages, built in the top layer first like a
+ * write would; see IO_ioctl.h for how the mapping and block I/O agree. */
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/miscdevice.h>
+#include <linux/blkdev.h>
+#include <linux/printk.h>
+
+#include "IO_driver.h"
+#include "IO_ioctl.h"
+
+static unsigned long rb_map_pages(struct rb_device *rb_dev){
+    return DIV_ROUND_UP(rb_dev->size, PAGE_SECTORS);
+}
+
+static vm_fault_t rb_map_fault(struct vm_fault *vmf){
+    struct rb_device *rb_dev = vmf->vma->vm_private_data;
+    struct page *page;
+    if(vmf->pgoff >= rb_map_pages(rb_dev))
+        return VM_FAULT_SIGBUS;
+    if(rb_dev->image && rb_image_fault(rb_dev, vmf->pgoff, true))
+        return VM_FAULT_SIGBUS;
+    page = rb_store_get_page(rb_dev, vmf->pgoff, GFP_KERNEL);
+    if(IS_ERR(page))
+        return VM_FAULT_OOM;
+    vmf->page = page;
+    return 0;
+}
+
+static const struct vm_operations_struct rb_map_vm_ops = {
+    .fault = rb_map_fault,
+};
+
+static int rb_map_open(struct inode *inode, struct file *file){
+    struct rb_device *rb_dev = container_of(file->private_data, struct rb_device, map_dev);
+    file->private_data = rb_dev;
+    atomic_inc(&rb_dev->map_users);
+    return 0;
+}
+
+static int rb_map_release(struct inode *inode, struct file *file){
+    struct rb_device *rb_dev = file->private_data;
+    atomic_dec(&rb_dev->map_users);
+    return 0;
+}
+
+static int rb_map_mmap(struct file *file, struct vm_area_struct *vma){
+    struct rb_device *rb_dev = file->private_data;
+    unsigned long nr_pages = rb_map_pages(rb_dev);
+    if(vma->vm_pgoff > nr_pages || vma_pages(vma) > nr_pages - vma->vm_pgoff)
+        return -EINVAL;
+    vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+    vma->vm_ops = &rb_map_vm_ops;
+    vma->vm_private_data = rb_dev;
+    return 0;
+}
+
+static long rb_map_ioctl(struct file *file, unsigned int cmd, unsigned long arg){
+    struct rb_device *rb_dev = file->private_data;
+    struct block_device *bdev = rb_dev->rb_disk->part0;
+    int err;
+    switch(cmd){
+    case RB_IOC_MAP_FLUSH:
+        /* dirty pages would not be dropped, and later overwrite ours */
+        err = sync_blockdev(bdev);
+        if(!err)
+            invalidate_bdev(bdev);
+        return err;
+    case RB_IOC_MAP_INVALIDATE:
+        err = sync_blockdev(bdev);
+        if(!err)
+            unmap_mapping_range(file->f_mapping, 0, 0, 0);
+        return err;
+    default:
+        return -ENOTTY;
+    }
+}
+
+static const struct file_operations rb_map_fops = {
+    .owner = THIS_MODULE,
+    .open = rb_map_open,
+    .release = rb_map_release,
+    .mmap = rb_map_mmap,
+    .unlocked_ioctl = rb_map_ioctl,
+    .llseek = noop_llseek,
+};
+
+int rb_map_add(struct rb_device *rb_dev){
+    int status;
+    snprintf(rb_dev->map_name, sizeof(rb_dev->map_name), "%s_mmap", rb_dev->rb_disk->disk_name);
+    rb_dev->map_dev.minor = MISC_DYNAMIC_MINOR;
+    rb_dev->map_dev.name = rb_dev->map_name;
+    rb_dev->map_dev.fops = &rb_map_fops;
+    status = misc_register(&rb_dev->map_dev);
+    if(status){
+        printk(KERN_ERR "Unable to register %s\n",rb_dev->map_name);
+        rb_dev->map_dev.name = NULL;
+    }
+    return status;
+}
+
+void rb_map_remove(struct rb_device *rb_dev){
+    if(rb_dev->map_dev.name)
+        misc_deregister(&rb_dev->map_dev);
+    rb_dev->map_dev.name = NULL;
+}
@@ -0,0 +1,130 @@
+/* Parallel copy engine: with par_threads, blk-mq reads and writes of at
+ * least par_copy_kb are cut in page aligned chunks, each copied by a
+ * worker on another CPU. The workqueue is per-CPU with one work item
+ * active per CPU, so a burst of large requests queues up rather than
+ * taking every CPU over. Whoever copies the last chunk completes the
+ * request, through the same path as queue_rq. */
+#include <linux/kernel.h>
+#include <linux/blkdev.h>
+#include <linux/blk-mq.h>
+#include <linux/cpumask.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
+#include <linux/atomic.h>
+
+#include "IO_driver.h"
+
+#define RB_PAR_MIN_CHUNK (128 * 1024)   /* smaller chunks are not worth a worker */
+
+static struct workqueue_struct *rb_par_wq;
+
+int rb_par_init(void){
+    /* requests may be writeback under memory pressure */
+    rb_par_wq = alloc_workqueue("rb_par", WQ_HIGHPRI | WQ_MEM_RECLAIM, 1);
+    if(!rb_par_wq)
+        return -ENOMEM;
+    return 0;
+}
+
+void rb_par_exit(void){
+    if(!rb_par_wq)
+        return;
+    destroy_workqueue(rb_par_wq);
+    rb_par_wq = NULL;
+}
+
+/* Number of chunks req is to be copied in, 1 to serve it inline */
+unsigned int rb_par_chunks(struct rb_device *rb_dev, struct request *req){
+    unsigned int bytes = blk_rq_bytes(req), threshold = READ_ONCE(rb_dev->par_bytes);
+    if(!rb_dev->par_threads || !threshold || bytes < threshold)
+        return 1;
+    if(req_op(req) != REQ_OP_READ && req_op(req) != REQ_OP_WRITE)
+        return 1;
+    return clamp_t(unsigned int, bytes / RB_PAR_MIN_CHUNK, 1, min(rb_dev->par_threads, num_online_cpus()));
+}
+
+/* Copy a chunk, from where it starts in the request's bios */
+static int rb_par_copy(struct rb_device *rb_dev, struct rb_par_chunk *chunk, int write, bool stream){
+    struct bio *bio = chunk->bio;
+    struct bvec_iter iter = chunk->iter;
+    unsigned int left = chunk->bytes;
+    sector_t sector = chunk->sector;
+    struct rb_csum csum, *cs;
+    struct bio_vec bv;
+    int err = 0;
+    /* chunks are whole pages, so whole blocks */
+    cs = rb_integ_begin(rb_dev, &csum, sector, write);
+    while(left){
+        if(!iter.bi_size){
+            bio = bio->bi_next;
+            iter = bio->bi_iter;
+        }
+        bv = mp_bvec_iter_bvec(bio->bi_io_vec, iter);
+        bv.bv_len = min(bv.bv_len, left);
+        /* workers may sleep for pages, unlike queue_rq */
+        err = rb_do_bvec(rb_dev, &bv, sector, write, cs, stream, GFP_NOIO);
+        if(err)
+            break;
+        bvec_iter_advance(bio->bi_io_vec, &iter, bv.bv_len);
+        sector += bv.bv_len >> SECTOR_SHIFT;
+        left -= bv.bv_len;
+    }
+    rb_integ_end(cs);
+    return err;
+}
+
+static void rb_par_work(struct work_struct *work){
+    struct rb_par_chunk *chunk = container_of(work, struct rb_par_chunk, work);
+    struct request *req = chunk->req;
+    struct rb_device *rb_dev = req->q->queuedata;
+    struct rb_cmd *cmd = blk_mq_rq_to_pdu(req);
+    int err;
+    err = rb_par_copy(rb_dev, chunk, rq_data_dir(req), rb_copy_stream(rb_dev, blk_rq_bytes(req)));
+    if(err)
+        cmpxchg(&cmd->err, 0, err);
+    if(!atomic_dec_and_test(&cmd->pending))
+        return;
+    if(!cmd->err)
+        rb_stats_account(rb_dev, req_op(req), blk_rq_bytes(req), cmd->segs, ktime_get_ns() - cmd->start);
+    rb_finish_rq(req, errno_to_blk_status(cmd->err), cmd->start);
+}
+
+/* Cut req in nr chunks and queue them on the CPUs after this one; the
+ * request was checked and started, and start is when it was submitted */
+void rb_par_submit(struct rb_device *rb_dev, struct request *req, unsigned int nr, u64 start){
+    struct rb_cmd *cmd = blk_mq_rq_to_pdu(req);
+    unsigned int bytes = blk_rq_bytes(req), size, off = 0, i = 0, segs = 0;
+    struct rb_par_chunk *chunk;
+    struct req_iterator it;
+    struct bio_vec bv;
+    int cpu;
+    size = round_up(DIV_ROUND_UP(bytes, nr), PAGE_SIZE);
+    nr = DIV_ROUND_UP(bytes, size);
+    rq_for_each_bvec(bv, req, it){
+        segs++;
+        /* chunks starting in this bio_vec */
+        while(i < nr && i * size < off + bv.bv_len){
+            chunk = &cmd->par[i];
+            INIT_WORK(&chunk->work, rb_par_work);
+            chunk->req = req;
+            chunk->bio = it.bio;
+            chunk->iter = it.iter;
+            bvec_iter_advance(it.bio->bi_io_vec, &chunk->iter, i * size - off);
+            chunk->sector = blk_rq_pos(req) + ((i * size) >> SECTOR_SHIFT);
+            chunk->bytes = min(size, bytes - i * size);
+            ++i;
+        }
+        off += bv.bv_len;
+    }
+    cmd->err = 0;
+    cmd->segs = segs;
+    cmd->start = start;
+    atomic_set(&cmd->pending, nr);
+    cpu = raw_smp_processor_id();
+    for(i = 0; i < nr; ++i){
+        cpu = cpumask_next(cpu, cpu_online_mask);
+        if(cpu >= nr_cpu_ids)
+            cpu = cpumask_first(cpu_online_mask);
+        queue_work_on(cpu, rb_par_wq, &cmd->par[i].work);
+    }
+}
@@ -0,0 +1,92 @@
+/* Shaping of blk-mq completions, to pass for a slower class of device.
+ * Requests are still served at once; their completion is held back to
+ * when two token buckets (IOPS and bytes/s) let them through, plus an
+ * added latency. The buckets are kept as GCRA-style theoretical arrival
+ * times: a request may go burst_ns before its bucket's time, which then
+ * moves on by the cost of the request at the limit rate. */
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/random.h>
+#include <linux/spinlock.h>
+
+#include "IO_driver.h"
+
+#define RB_SHAPE_BURST_NS (1000 * NSEC_PER_USEC)    /* default bucket depth */
+#define RB_LN2_FP 45426                             /* ln(2) in 16.16 */
+
+void rb_shape_init(struct rb_device *rb_dev){
+    struct rb_shape *sh = &rb_dev->shape;
+    spin_lock_init(&sh->lock);
+    sh->burst_ns = RB_SHAPE_BURST_NS;
+}
+
+/* Forget the bucket times, so a new limit applies from now */
+void rb_shape_reset(struct rb_device *rb_dev){
+    struct rb_shape *sh = &rb_dev->shape;
+    unsigned long flags;
+    spin_lock_irqsave(&sh->lock, flags);
+    sh->iops_tat = 0;
+    sh->bps_tat = 0;
+    spin_unlock_irqrestore(&sh->lock, flags);
+}
+
+/* Earliest time a request costing cost_ns may go, taking it from the bucket */
+static u64 rb_bucket_take(u64 *tat, u64 now, u64 cost_ns, u64 burst_ns){
+    u64 t = *tat > now + burst_ns ? *tat - burst_ns : now;
+    *tat = max(*tat, now) + cost_ns;
+    return t;
+}
+
+/* log2(x) in 16.16 fixed point, x > 0 */
+static u32 rb_log2_fp(u32 x){
+    u32 ip = ilog2(x), fp = 0;
+    u64 m = ((u64)x << 31) >> ip;   /* x / 2^ip in 1.31, in [1, 2) */
+    int i;
+    for(i = 15; i >= 0; --i){
+        m = (m * m) >> 31;
+        if(m >= 1ULL << 32){
+            m >>= 1;
+            fp |= 1U << i;
+        }
+    }
+    return ip << 16 | fp;
+}
+
+static u64 rb_shape_latency(struct rb_shape *sh){
+    u64 mean = READ_ONCE(sh->latency_ns);
+    u32 r;
+    switch(READ_ONCE(sh->latency_dist)){
+    case RB_LAT_UNIFORM:
+        return mul_u64_u32_shr(2 * mean, get_random_u32(), 32);
+    case RB_LAT_EXP:
+        /* -ln(u) for u uniform in (0, 1), at most ~22 */
+        r = get_random_u32() | 1;
+        return mul_u64_u32_shr(mean, (u32)(((u64)((32 << 16) - rb_log2_fp(r)) * RB_LN2_FP) >> 16), 16);
+    default:
+        return mean;
+    }
+}
+
+/* Absolute time (ktime_get_ns) a request of bytes submitted at now may
+ * complete, 0 when the device is not shaped. Backing file completions
+ * get here from interrupt context, hence the irqsave. */
+u64 rb_shape_deadline(struct rb_device *rb_dev, unsigned int bytes, u64 now){
+    struct rb_shape *sh = &rb_dev->shape;
+    u64 iops = READ_ONCE(sh->iops), bps = READ_ONCE(sh->bps);
+    u64 burst, t = now;
+    unsigned long flags;
+    if(!iops && !bps && !READ_ONCE(sh->latency_ns))
+        return 0;
+    if(iops || bps){
+        burst = READ_ONCE(sh->burst_ns);
+        spin_lock_irqsave(&sh->lock, flags);
+        if(iops)
+            t = max(t, rb_bucket_take(&sh->iops_tat, now, div64_u64(NSEC_PER_SEC, iops), burst));
+        if(bps)
+            t = max(t, rb_bucket_take(&sh->bps_tat, now, div64_u64((u64)bytes * NSEC_PER_SEC, bps), burst));
+        spin_unlock_irqrestore(&sh->lock, flags);
+    }
+    return t + rb_shape_latency(sh);
+}
@@ -0,0 +1,193 @@
+/* Per-CPU I/O statistics of a ramdisk, shown in debugfs under
+ * /sys/kernel/debug/<name>/<disk>/ */
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/log2.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+#include "IO_driver.h"
+
+static struct dentry *rb_debugfs_root;
+
+static const char * const rb_dir_names[RB_STAT_DIRS] = {
+    [RB_STAT_READ] = "read",
+    [RB_STAT_WRITE] = "write",
+    [RB_STAT_DISCARD] = "discard",
+};
+
+static unsigned int rb_hist_bucket(u64 val){
+    if(!val)
+        return 0;
+    return min_t(unsigned int, ilog2(val), RB_HIST_BUCKETS - 1);
+}
+
+/* Called once per completed request; ns is the time spent serving it */
+void rb_stats_account(struct rb_device *rb_dev, enum req_op op, unsigned int bytes, unsigned int segs, u64 ns){
+    struct rb_stats *stats;
+    int dir;
+    switch(op){
+    case REQ_OP_READ:
+        dir = RB_STAT_READ;
+        break;
+    case REQ_OP_WRITE:
+    case REQ_OP_ZONE_APPEND:
+        dir = RB_STAT_WRITE;
+        break;
+    case REQ_OP_DISCARD:
+    case REQ_OP_WRITE_ZEROES:
+        dir = RB_STAT_DISCARD;
+        break;
+    default:
+        return;
+    }
+    stats = get_cpu_ptr(rb_dev->stats);
+    stats->ops[dir]++;
+    stats->bytes[dir] += bytes;
+    stats->lat_hist[dir][rb_hist_bucket(ns)]++;
+    if(segs){
+        stats->segments += segs;
+        stats->seg_hist[rb_hist_bucket(segs)]++;
+    }
+    put_cpu_ptr(rb_dev->stats);
+}
+
+void rb_stats_sum(struct rb_device *rb_dev, struct rb_stats *sum){
+    struct rb_stats *stats;
+    int cpu, dir, i;
+    memset(sum, 0, sizeof(*sum));
+    for_each_possible_cpu(cpu){
+        stats = per_cpu_ptr(rb_dev->stats, cpu);
+        for(dir = 0; dir < RB_STAT_DIRS; ++dir){
+            sum->ops[dir] += stats->ops[dir];
+            sum->bytes[dir] += stats->bytes[dir];
+            for(i = 0; i < RB_HIST_BUCKETS; ++i)
+                sum->lat_hist[dir][i] += stats->lat_hist[dir][i];
+        }
+        for(i = 0; i < RB_HIST_BUCKETS; ++i)
+            sum->seg_hist[i] += stats->seg_hist[i];
+        sum->segments += stats->segments;
+        sum->misaligned += stats->misaligned;
+        sum->numa_local += stats->numa_local;
+        sum->numa_remote += stats->numa_remote;
+        sum->tier_hits += stats->tier_hits;
+        sum->tier_misses += stats->tier_misses;
+        sum->tier_demoted += stats->tier_demoted;
+        sum->huge_folios += stats->huge_folios;
+        sum->huge_fallbacks += stats->huge_fallbacks;
+        sum->integ_verified += stats->integ_verified;
+        sum->integ_rechecked += stats->integ_rechecked;
+        sum->integ_errors += stats->integ_errors;
+        sum->cache_hits += stats->cache_hits;
+        sum->cache_misses += stats->cache_misses;
+        sum->cache_written += stats->cache_written;
+        sum->cache_batches += stats->cache_batches;
+        sum->cache_syncs += stats->cache_syncs;
+    }
+}
+
+/* Racy against requests in flight, which at worst survive the reset */
+static void rb_stats_reset(struct rb_device *rb_dev){
+    int cpu;
+    for_each_possible_cpu(cpu)
+        memset(per_cpu_ptr(rb_dev->stats, cpu), 0, sizeof(struct rb_stats));
+}
+
+static int rb_counters_show(struct seq_file *m, void *v){
+    struct rb_device *rb_dev = m->private;
+    struct rb_stats sum;
+    int dir;
+    rb_stats_sum(rb_dev, &sum);
+    for(dir = 0; dir < RB_STAT_DIRS; ++dir){
+        seq_printf(m, "%s_ops %llu\n", rb_dir_names[dir], sum.ops[dir]);
+        seq_printf(m, "%s_bytes %llu\n", rb_dir_names[dir], sum.bytes[dir]);
+    }
+    seq_printf(m, "segments %llu\n", sum.segments);
+    seq_printf(m, "misaligned_bvecs %llu\n", sum.misaligned);
+    seq_printf(m, "numa_local %llu\n", sum.numa_local);
+    seq_printf(m, "numa_remote %llu\n", sum.numa_remote);
+    seq_printf(m, "tier_hits %llu\n", sum.tier_hits);
+    seq_printf(m, "tier_misses %llu\n", sum.tier_misses);
+    seq_printf(m, "tier_demoted %llu\n", sum.tier_demoted);
+    seq_printf(m, "huge_folios %llu\n", sum.huge_folios);
+    seq_printf(m, "huge_fallbacks %llu\n", sum.huge_fallbacks);
+    seq_printf(m, "integ_verified %llu\n", sum.integ_verified);
+    seq_printf(m, "integ_rechecked %llu\n", sum.integ_rechecked);
+    seq_printf(m, "integ_errors %llu\n", sum.integ_errors);
+    seq_printf(m, "cache_hits %llu\n", sum.cache_hits);
+    seq_printf(m, "cache_misses %llu\n", sum.cache_misses);
+    seq_printf(m, "cache_dirty_pages %ld\n", atomic_long_read(&rb_dev->cache_dirty_pages));
+    seq_printf(m, "cache_written %llu\n", sum.cache_written);
+    seq_printf(m, "cache_batches %llu\n", sum.cache_batches);
+    seq_printf(m, "cache_syncs %llu\n", sum.cache_syncs);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(rb_counters);
+
+/* One line per log2 bucket of service time: [2^i, 2^(i+1)) ns */
+static int rb_latency_show(struct seq_file *m, void *v){
+    struct rb_device *rb_dev = m->private;
+    struct rb_stats sum;
+    int dir, i;
+    rb_stats_sum(rb_dev, &sum);
+    seq_puts(m, "ns");
+    for(dir = 0; dir < RB_STAT_DIRS; ++dir)
+        seq_printf(m, " %s", rb_dir_names[dir]);
+    seq_putc(m, '\n');
+    for(i = 0; i < RB_HIST_BUCKETS; ++i){
+        seq_printf(m, "%llu", 1ULL << i);
+        for(dir = 0; dir < RB_STAT_DIRS; ++dir)
+            seq_printf(m, " %llu", sum.lat_hist[dir][i]);
+        seq_putc(m, '\n');
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(rb_latency);
+
+/* Requests by log2 bucket of bio_vecs carried */
+static int rb_segments_show(struct seq_file *m, void *v){
+    struct rb_device *rb_dev = m->private;
+    struct rb_stats sum;
+    int i;
+    rb_stats_sum(rb_dev, &sum);
+    seq_puts(m, "segments requests\n");
+    for(i = 0; i < RB_HIST_BUCKETS; ++i)
+        seq_printf(m, "%llu %llu\n", 1ULL << i, sum.seg_hist[i]);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(rb_segments);
+
+static ssize_t rb_reset_write(struct file *file, const char __user *ubuf, size_t count, loff_t *ppos){
+    rb_stats_reset(file->private_data);
+    return count;
+}
+
+static const struct file_operations rb_reset_fops = {
+    .owner = THIS_MODULE,
+    .open = simple_open,
+    .write = rb_reset_write,
+    .llseek = noop_llseek,
+};
+
+void rb_debugfs_init(const char *name){
+    rb_debugfs_root = debugfs_create_dir(name, NULL);
+}
+
+void rb_debugfs_exit(void){
+    debugfs_remove_recursive(rb_debugfs_root);
+}
+
+void rb_debugfs_add(struct rb_device *rb_dev){
+    struct dentry *dir;
+    dir = debugfs_create_dir(rb_dev->rb_disk->disk_name, rb_debugfs_root);
+    debugfs_create_file("stats", 0444, dir, rb_dev, &rb_counters_fops);
+    debugfs_create_file("latency_hist", 0444, dir, rb_dev, &rb_latency_fops);
+    debugfs_create_file("segments_hist", 0444, dir, rb_dev, &rb_segments_fops);
+    debugfs_create_file("reset", 0200, dir, rb_dev, &rb_reset_fops);
+    rb_dev->debugfs_dir = dir;
+}
+
+void rb_debugfs_remove(struct rb_device *rb_dev){
+    debugfs_remove_recursive(rb_dev->debugfs_dir);
+}
@@ -0,0 +1,692 @@
+/* Sparse backing store: one page per PAGE_SIZE chunk of the device,
+ * allocated on first write. Unwritten chunks read back as zeroes, and
+ * pages holding one repeated word keep only that word in their entry.
+ * With compression on, entries are handed to IO_comp.c instead.
+ * Snapshots stack the index in layers, see struct rb_layer: a page is
+ * copied up to the top layer the first time it is written. With
+ * huge_pages, the first write to an aligned 2 MiB range backs all of it
+ * with one folio, each of its pages still having its own entry. */
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/gfp.h>
+#include <linux/highmem.h>
+#include <linux/sched.h>
+#include <linux/nodemask.h>
+#include <linux/topology.h>
+#include <linux/percpu.h>
+#include <linux/xarray.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/rcupdate.h>
+#include <linux/string.h>
+#include <linux/mutex.h>
+
+#include "IO_driver.h"
+
+#define RB_HUGE_ORDER (PMD_SHIFT - PAGE_SHIFT)  /* huge_pages folios, 2 MiB on x86-64 */
+#define RB_FOLIO_COPY_PAGES 16                  /* most pages of one rb_folio_copy() */
+
+/* Each page of a huge folio in the store holds a reference on it, on top
+ * of the folio's own. Drop nr of page's references, and return the folio
+ * once it is to be freed, NULL while some of its pages remain. */
+static struct folio *rb_page_unref(struct page *page, unsigned long nr){
+    struct folio *folio = page_folio(page);
+    if(!folio_test_large(folio))
+        return folio;
+    return folio_ref_sub_return(folio, nr) == 1 ? folio : NULL;
+}
+
+void rb_entry_free(void *entry){
+    struct folio *folio;
+    if(!entry || rb_entry_is_fill(entry))
+        return;
+    if(rb_entry_is_obj(entry)){
+        kfree(rb_entry_obj(entry));
+        return;
+    }
+    folio = rb_page_unref(entry, 1);
+    if(folio)
+        folio_put(folio);
+}
+
+/* New empty layer over parent, whose reference it takes over */
+static struct rb_layer *rb_layer_alloc(struct rb_layer *parent){
+    struct rb_layer *layer;
+    layer = kzalloc(sizeof(*layer), GFP_KERNEL);
+    if(!layer)
+        return NULL;
+    refcount_set(&layer->ref, 1);
+    xa_init(&layer->pages);
+    layer->parent = parent;
+    return layer;
+}
+
+/* Drop a reference, and with the last one the layer and what it held
+ * up: iterative, stacks of snapshots can be deep */
+void rb_layer_put(struct rb_layer *layer){
+    struct rb_layer *parent;
+    unsigned long idx;
+    void *entry;
+    while(layer && refcount_dec_and_test(&layer->ref)){
+        xa_for_each(&layer->pages, idx, entry){
+            rb_entry_free(entry);
+            cond_resched();
+        }
+        xa_destroy(&layer->pages);
+        parent = layer->parent;
+        kfree(layer);
+        layer = parent;
+    }
+}
+
+/* Start with an empty top layer, over base if the device is a snapshot */
+int rb_store_init(struct rb_device *rb_dev, struct rb_layer *base){
+    int i;
+    rb_dev->top = rb_layer_alloc(base);
+    if(!rb_dev->top)
+        return -ENOMEM;
+    if(base)
+        refcount_inc(&base->ref);
+    rb_dev->pages = &rb_dev->top->pages;
+    for(i = 0; i < RB_SLOT_LOCKS; ++i)
+        spin_lock_init(&rb_dev->slot_locks[i]);
+    return 0;
+}
+
+void rb_store_free(struct rb_device *rb_dev){
+    rb_layer_put(rb_dev->top);
+    rb_dev->top = NULL;
+    rb_dev->pages = NULL;
+    /* pages still waiting for a grace period */
+    rcu_barrier();
+}
+
+/* Freeze the device's pages into a layer a snapshot can share, the
+ * device going on over a new empty top. The caller has the queue frozen
+ * and gets a reference on the frozen layer. */
+struct rb_layer *rb_store_split(struct rb_device *rb_dev){
+    struct rb_layer *base = rb_dev->top, *top;
+    top = rb_layer_alloc(base);
+    if(!top)
+        return NULL;
+    refcount_inc(&base->ref);
+    rb_dev->top = top;
+    rb_dev->pages = &top->pages;
+    return base;
+}
+
+/* Entry for idx in the frozen layers under the top, nearest first */
+void *rb_base_load(struct rb_device *rb_dev, unsigned long idx){
+    struct rb_layer *layer;
+    void *entry;
+    for(layer = rb_dev->top->parent; layer; layer = layer->parent){
+        entry = xa_load(&layer->pages, idx);
+        if(entry)
+            return entry;
+    }
+    return NULL;
+}
+
+int rb_nth_online_node(unsigned long nth){
+    int node = first_online_node;
+    nth %= num_online_nodes();
+    while(nth--)
+        node = next_online_node(node);
+    return node;
+}
+
+/* Node a new page for idx should come from, per the device's policy */
+int rb_store_node(struct rb_device *rb_dev, unsigned long idx){
+    switch(rb_dev->numa_policy){
+    case RB_NUMA_NODE:
+        return rb_dev->node;
+    case RB_NUMA_INTERLEAVE:
+        return rb_nth_online_node(idx);
+    default:
+        return numa_node_id();
+    }
+}
+
+static void rb_account_node(struct rb_device *rb_dev, struct page *page){
+    if(page_to_nid(page) == numa_node_id())
+        this_cpu_inc(rb_dev->stats->numa_local);
+    else
+        this_cpu_inc(rb_dev->stats->numa_remote);
+}
+
+/* Fill len bytes at dst with word, len a multiple of the word size */
+void rb_fill_buf(void *dst, unsigned long word, unsigned int len){
+    if(!word)
+        memset(dst, 0, len);
+    else
+        memset_l(dst, word, len / sizeof(word));
+}
+
+static void rb_fill_page(struct page *page, unsigned long word){
+    void *addr = kmap_local_page(page);
+    rb_fill_buf(addr, word, PAGE_SIZE);
+    kunmap_local(addr);
+}
+
+/* True if the page at src is one machine word repeated, that word being
+ * small enough to live in a fill entry */
+bool rb_same_filled(const void *src, unsigned long *word){
+    const unsigned long *p = src;
+    unsigned int i, last = PAGE_SIZE / sizeof(*p) - 1;
+    /* most pages differ at one end or the other */
+    if(p[0] != p[last])
+        return false;
+    for(i = 1; i < last; ++i){
+        if(p[i] != p[0])
+            return false;
+    }
+    *word = p[0];
+    return rb_fill_fits(*word);
+}
+
+/* Set a new page to what a plain store entry holds */
+static void rb_page_set(struct page *page, void *entry){
+    if(!entry)
+        rb_fill_page(page, 0);
+    else if(rb_entry_is_fill(entry))
+        rb_fill_page(page, rb_entry_fill(entry));
+    else
+        copy_highpage(page, entry);
+}
+
+static void rb_free_folio_rcu(struct rcu_head *head){
+    folio_put(container_of(head, struct folio, rcu_head));
+}
+
+/* Drop an entry unlinked from a plain store: readers and in-place
+ * writers may still hold its page under rcu_read_lock() */
+static void rb_drop_entry(struct rb_device *rb_dev, void *entry){
+    struct folio *folio;
+    if(!entry)
+        return;
+    if(rb_entry_is_fill(entry)){
+        atomic_long_dec(&rb_dev->same_pages);
+        return;
+    }
+    atomic_long_dec(&rb_dev->ram_pages);
+    folio = rb_page_unref(entry, 1);
+    if(folio)
+        call_rcu(&folio->rcu_head, rb_free_folio_rcu);
+}
+
+/* Replace page idx by a fill entry */
+static int rb_page_fill(struct rb_device *rb_dev, unsigned long idx, unsigned long word, gfp_t gfp){
+    void *old;
+    old = xa_store(rb_dev->pages, idx, rb_mk_fill(word), gfp);
+    if(xa_is_err(old))
+        return xa_err(old);
+    atomic_long_inc(&rb_dev->same_pages);
+    rb_drop_entry(rb_dev, old);
+    return 0;
+}
+
+/* huge_pages: back the aligned range of pages around idx with a single
+ * zeroed folio, if the store holds none of them yet. Returns 0 once some
+ * of its pages are in, the caller falling back to a single page else. */
+static int rb_huge_fill(struct rb_device *rb_dev, unsigned long idx, gfp_t gfp){
+    unsigned long nr = 1UL << RB_HUGE_ORDER, first = idx & ~(nr - 1), i, done = 0;
+    unsigned long next = first;
+    struct folio *folio;
+    struct page *page;
+    /* snapshots copy pages up one by one, from the layers below */
+    if(rb_dev->top->parent || first + nr > DIV_ROUND_UP(rb_dev->size, PAGE_SECTORS))
+        return -EINVAL;
+    if(xa_find(rb_dev->pages, &next, first + nr - 1, XA_PRESENT))
+        return -EEXIST;
+    page = alloc_pages_node(rb_store_node(rb_dev, first), gfp | __GFP_HIGHMEM | __GFP_COMP | __GFP_ZERO | __GFP_NORETRY | __GFP_NOWARN, RB_HUGE_ORDER);
+    if(!page){
+        this_cpu_inc(rb_dev->stats->huge_fallbacks);
+        return -ENOMEM;
+    }
+    folio = page_folio(page);
+    folio_ref_add(folio, nr);
+    for(i = 0; i < nr; ++i){
+        if(!xa_cmpxchg(rb_dev->pages, first + i, NULL, folio_page(folio, i), gfp))
+            ++done;
+    }
+    atomic_long_add(done, &rb_dev->ram_pages);
+    /* the references of the pages that lost a race */
+    folio = rb_page_unref(page, nr - done);
+    if(folio)
+        call_rcu(&folio->rcu_head, rb_free_folio_rcu);
+    if(!done)
+        return -EEXIST;
+    this_cpu_inc(rb_dev->stats->huge_folios);
+    return 0;
+}
+
+/* Write len bytes of src (zeroes if NULL) at offset in page idx. Pages
+ * of the top layer are written in place; absent and filled ones are built
+ * aside, from what the layers below hold, and swapped in, going again if
+ * another writer swapped first. */
+static int rb_page_write(struct rb_device *rb_dev, unsigned long idx, const void *src, unsigned int offset, unsigned int len, bool stream, gfp_t gfp){
+    struct page *page = NULL;
+    unsigned long word = 0;
+    void *entry, *from, *cur;
+    if(len == PAGE_SIZE && (!src || rb_same_filled(src, &word)))
+        return rb_page_fill(rb_dev, idx, word, gfp);
+    for(;;){
+        rcu_read_lock();
+        entry = xa_load(rb_dev->pages, idx);
+        if(entry && !rb_entry_is_fill(entry)){
+            rb_account_node(rb_dev, entry);
+            if(src)
+                rb_copy_to_page(entry, offset, src, len, stream);
+            else
+                memzero_page(entry, offset, len);
+            rcu_read_unlock();
+            break;
+        }
+        rcu_read_unlock();
+        from = entry ? entry : rb_base_load(rb_dev, idx);
+        if(!src && rb_entry_is_zero(from))
+            break;
+        /* on success page idx is there to be written in place */
+        if(!entry && !page && rb_dev->huge && !rb_huge_fill(rb_dev, idx, gfp))
+            continue;
+        if(!page){
+            page = alloc_pages_node(rb_store_node(rb_dev, idx), gfp | __GFP_HIGHMEM, 0);
+            if(!page)
+                return -ENOMEM;
+        }
+        if(len < PAGE_SIZE)
+            rb_page_set(page, from);
+        if(src)
+            rb_copy_to_page(page, offset, src, len, stream);
+        else
+            memzero_page(page, offset, len);
+        cur = xa_cmpxchg(rb_dev->pages, idx, entry, page, gfp);
+        if(cur == entry){
+            if(entry)
+                atomic_long_dec(&rb_dev->same_pages);
+            atomic_long_inc(&rb_dev->ram_pages);
+            rb_account_node(rb_dev, page);
+            return 0;
+        }
+        if(xa_is_err(cur)){
+            __free_page(page);
+            return xa_err(cur);
+        }
+    }
+    if(page)
+        __free_page(page);
+    return 0;
+}
+
+static void rb_page_read(struct rb_device *rb_dev, unsigned long idx, void *dst, unsigned int offset, unsigned int len, bool stream){
+    void *entry;
+    rcu_read_lock();
+    entry = xa_load(rb_dev->pages, idx);
+    if(!entry)
+        entry = rb_base_load(rb_dev, idx);
+    if(!entry){
+        memset(dst, 0, len);
+    }else if(rb_entry_is_fill(entry)){
+        rb_fill_buf(dst, rb_entry_fill(entry), len);
+    }else{
+        rb_account_node(rb_dev, entry);
+        rb_copy_from_page(dst, entry, offset, len, stream);
+    }
+    rcu_read_unlock();
+}
+
+/* huge_pages: copy len bytes between buf and offset in page idx, in
+ * place and in one pass over the pages after it in the same folio, 64
+ * KiB at most. The pages are looked up under RCU, the copy is done
+ * outside it with a reference on the folio. Returns the bytes copied, 0
+ * if page idx is not in a huge folio. Whole pages written this way are
+ * not turned into fill entries, their folio would stay allocated anyway. */
+static unsigned int rb_folio_copy(struct rb_device *rb_dev, unsigned long idx, void *buf, unsigned int offset, unsigned int len, bool write, bool stream){
+    XA_STATE(xas, rb_dev->pages, idx);
+    unsigned int nr = 1, max, done;
+    unsigned long first;
+    struct folio *folio;
+    struct page *page;
+    void *addr;
+    rcu_read_lock();
+    page = xas_load(&xas);
+    if(!page || xa_is_internal(page) || rb_entry_is_fill(page) || PageHighMem(page))
+        goto out;
+    folio = page_folio(page);
+    if(!folio_test_large(folio))
+        goto out;
+    first = folio_page_idx(folio, page);
+    max = min_t(unsigned long, DIV_ROUND_UP(offset + len, PAGE_SIZE), folio_nr_pages(folio) - first);
+    max = min_t(unsigned int, max, RB_FOLIO_COPY_PAGES);
+    /* being freed, or freed and reused since the lookup: the caller goes
+     * page by page */
+    if(!folio_try_get(folio))
+        goto out;
+    if(xas_reload(&xas) != page || page_folio(page) != folio){
+        folio_put(folio);
+        goto out;
+    }
+    /* pages of the folio may have been dropped or replaced since */
+    while(nr < max && xas_next(&xas) == (void *)folio_page(folio, first + nr))
+        ++nr;
+    rcu_read_unlock();
+    done = min_t(unsigned int, len, nr * PAGE_SIZE - offset);
+    addr = page_address(page) + offset;
+    rb_account_node(rb_dev, page);
+    if(write)
+        rb_copy(addr, buf, done, stream);
+    else
+        rb_copy(buf, addr, done, stream);
+    folio_put(folio);
+    return done;
+out:
+    rcu_read_unlock();
+    return 0;
+}
+
+/* Page idx of the top layer with a reference held, for a user mapping.
+ * Absent and filled pages are built and swapped in as by a write. */
+struct page *rb_store_get_page(struct rb_device *rb_dev, unsigned long idx, gfp_t gfp){
+    struct page *page = NULL;
+    void *entry, *cur;
+    for(;;){
+        rcu_read_lock();
+        entry = xa_load(rb_dev->pages, idx);
+        if(entry && !rb_entry_is_fill(entry) && get_page_unless_zero(entry)){
+            rcu_read_unlock();
+            if(page)
+                __free_page(page);
+            return entry;
+        }
+        rcu_read_unlock();
+        if(!page){
+            page = alloc_pages_node(rb_store_node(rb_dev, idx), gfp | __GFP_HIGHMEM, 0);
+            if(!page)
+                return ERR_PTR(-ENOMEM);
+        }
+        rb_page_set(page, entry ? entry : rb_base_load(rb_dev, idx));
+        cur = xa_cmpxchg(rb_dev->pages, idx, entry, page, gfp);
+        if(cur == entry){
+            if(entry)
+                atomic_long_dec(&rb_dev->same_pages);
+            atomic_long_inc(&rb_dev->ram_pages);
+            get_page(page);
+            return page;
+        }
+        if(xa_is_err(cur)){
+            __free_page(page);
+            return ERR_PTR(xa_err(cur));
+        }
+    }
+}
+
+/* Copy page idx of a plain store to buf, if it is held in a page */
+bool rb_store_copy_page(struct rb_device *rb_dev, unsigned long idx, void *buf){
+    void *entry;
+    bool ret = false;
+    rcu_read_lock();
+    entry = xa_load(rb_dev->pages, idx);
+    if(entry && !rb_entry_is_fill(entry)){
+        memcpy_from_page(buf, entry, 0, PAGE_SIZE);
+        ret = true;
+    }
+    rcu_read_unlock();
+    return ret;
+}
+
+/* Copy page idx of a plain store to buf, whatever holds it */
+void rb_store_peek_page(struct rb_device *rb_dev, unsigned long idx, void *buf){
+    void *entry;
+    rcu_read_lock();
+    entry = xa_load(rb_dev->pages, idx);
+    if(!entry)
+        memset(buf, 0, PAGE_SIZE);
+    else if(rb_entry_is_fill(entry))
+        rb_fill_buf(buf, rb_entry_fill(entry), PAGE_SIZE);
+    else
+        memcpy_from_page(buf, entry, 0, PAGE_SIZE);
+    rcu_read_unlock();
+}
+
+/* Take page idx out of a plain store, its content being kept elsewhere */
+void rb_store_evict(struct rb_device *rb_dev, unsigned long idx){
+    rb_drop_entry(rb_dev, xa_erase(rb_dev->pages, idx));
+}
+
+/* Store a whole page, bypassing the image */
+int rb_store_put(struct rb_device *rb_dev, unsigned long idx, const void *src, gfp_t gfp){
+    if(rb_dev->comp)
+        return rb_comp_write(rb_dev, idx, src, 0, PAGE_SIZE, gfp);
+    return rb_page_write(rb_dev, idx, src, 0, PAGE_SIZE, false, gfp);
+}
+
+/* Bring page idx back from the image if it has to be before it is used;
+ * a tiered device keeps it locked until rb_store_exit() */
+static int rb_store_enter(struct rb_device *rb_dev, unsigned long idx, bool load){
+    rb_cache_access(rb_dev, idx, load);
+    if(rb_dev->tier_pages)
+        return rb_tier_enter(rb_dev, idx, load);
+    if(rb_dev->image)
+        return rb_image_fault(rb_dev, idx, load);
+    return 0;
+}
+
+static void rb_store_exit(struct rb_device *rb_dev, unsigned long idx){
+    if(rb_dev->tier_pages)
+        rb_tier_exit(rb_dev, idx);
+}
+
+int rb_store_write(struct rb_device *rb_dev, const void *src, sector_t sector, unsigned int len, bool stream, gfp_t gfp){
+    unsigned int offset, chunk, done;
+    unsigned long idx;
+    int err;
+    while(len){
+        offset = (sector & (PAGE_SECTORS - 1)) << SECTOR_SHIFT;
+        chunk = min_t(unsigned int, len, PAGE_SIZE - offset);
+        idx = sector >> PAGE_SECTORS_SHIFT;
+        /* pages of an image are faulted in one at a time */
+        if(rb_dev->huge && !rb_dev->image){
+            done = rb_folio_copy(rb_dev, idx, (void *)src, offset, len, true, stream);
+            if(done){
+                src += done;
+                sector += done >> SECTOR_SHIFT;
+                len -= done;
+                continue;
+            }
+        }
+        /* a whole page overwrite has no use for the image copy */
+        err = rb_store_enter(rb_dev, idx, chunk < PAGE_SIZE);
+        if(err)
+            return err;
+        if(rb_dev->comp)
+            err = rb_comp_write(rb_dev, idx, src, offset, chunk, gfp);
+        else
+            err = rb_page_write(rb_dev, idx, src, offset, chunk, stream, gfp);
+        /* under the tier's lock, before a demotion can see the page */
+        if(!err)
+            rb_cache_dirty(rb_dev, idx);
+        rb_store_exit(rb_dev, idx);
+        if(err)
+            return err;
+        src += chunk;
+        sector += chunk >> SECTOR_SHIFT;
+        len -= chunk;
+    }
+    return 0;
+}
+
+int rb_store_read(struct rb_device *rb_dev, void *dst, sector_t sector, unsigned int len, bool stream){
+    unsigned int offset, chunk, done;
+    unsigned long idx;
+    int err;
+    while(len){
+        offset = (sector & (PAGE_SECTORS - 1)) << SECTOR_SHIFT;
+        chunk = min_t(unsigned int, len, PAGE_SIZE - offset);
+        idx = sector >> PAGE_SECTORS_SHIFT;
+        if(rb_dev->huge && !rb_dev->image){
+            done = rb_folio_copy(rb_dev, idx, dst, offset, len, false, stream);
+            if(done){
+                dst += done;
+                sector += done >> SECTOR_SHIFT;
+                len -= done;
+                continue;
+            }
+        }
+        err = rb_store_enter(rb_dev, idx, true);
+        if(err)
+            return err;
+        if(rb_dev->comp)
+            err = rb_comp_read(rb_dev, idx, dst, offset, chunk);
+        else
+            rb_page_read(rb_dev, idx, dst, offset, chunk, stream);
+        rb_store_exit(rb_dev, idx);
+        if(err)
+            return err;
+        dst += chunk;
+        sector += chunk >> SECTOR_SHIFT;
+        len -= chunk;
+    }
+    return 0;
+}
+
+/* Zero [start, end) in the pages that exist, in any layer; absent ones
+ * already read as 0 */
+static int rb_zero_range(struct rb_device *rb_dev, sector_t start, sector_t end, gfp_t gfp){
+    struct rb_layer *layer;
+    unsigned int offset, chunk;
+    sector_t from, to;
+    unsigned long idx;
+    void *entry;
+    int err;
+    if(start >= end)
+        return 0;
+    for(layer = rb_dev->top; layer; layer = layer->parent){
+        xa_for_each_range(&layer->pages, idx, entry, start >> PAGE_SECTORS_SHIFT, (end - 1) >> PAGE_SECTORS_SHIFT){
+            /* copied up and zeroed already */
+            if(layer != rb_dev->top && xa_load(rb_dev->pages, idx))
+                continue;
+            from = max_t(sector_t, start, (sector_t)idx << PAGE_SECTORS_SHIFT);
+            to = min_t(sector_t, end, (sector_t)(idx + 1) << PAGE_SECTORS_SHIFT);
+            offset = (from & (PAGE_SECTORS - 1)) << SECTOR_SHIFT;
+            chunk = (to - from) << SECTOR_SHIFT;
+            if(rb_dev->comp)
+                err = rb_comp_write(rb_dev, idx, NULL, offset, chunk, gfp);
+            else
+                err = rb_page_write(rb_dev, idx, NULL, offset, chunk, false, gfp);
+            if(err)
+                return err;
+        }
+    }
+    return 0;
+}
+
+/* Give page idx back: erase it, or mask it with a zero fill while a
+ * layer below still holds data there */
+static int rb_store_drop(struct rb_device *rb_dev, unsigned long idx, gfp_t gfp){
+    if(!rb_entry_is_zero(rb_base_load(rb_dev, idx))){
+        if(rb_dev->comp)
+            return rb_comp_write(rb_dev, idx, NULL, 0, PAGE_SIZE, gfp);
+        return rb_page_fill(rb_dev, idx, 0, gfp);
+    }
+    if(rb_dev->comp)
+        rb_comp_erase(rb_dev, idx);
+    else
+        rb_drop_entry(rb_dev, xa_erase(rb_dev->pages, idx));
+    return 0;
+}
+
+/* Before a discard, settle the image copy of the pages in [start, end):
+ * partly covered ones are read in, the others are dropped */
+static int rb_image_settle(struct rb_device *rb_dev, sector_t start, sector_t end){
+    sector_t from, to;
+    unsigned long idx;
+    int err;
+    if(start >= end)
+        return 0;
+    for(idx = start >> PAGE_SECTORS_SHIFT; idx <= (end - 1) >> PAGE_SECTORS_SHIFT; ++idx){
+        from = max_t(sector_t, start, (sector_t)idx << PAGE_SECTORS_SHIFT);
+        to = min_t(sector_t, end, (sector_t)(idx + 1) << PAGE_SECTORS_SHIFT);
+        err = rb_image_fault(rb_dev, idx, to - from < PAGE_SECTORS);
+        if(err)
+            return err;
+    }
+    return 0;
+}
+
+/* Discard on a tiered device: one page at a time under its image lock,
+ * so that demotion never sees a page half dropped */
+static int rb_tier_discard(struct rb_device *rb_dev, sector_t start, sector_t end, bool unmap, gfp_t gfp){
+    unsigned int offset, chunk;
+    struct mutex *lock;
+    sector_t from, to;
+    unsigned long idx;
+    int err = 0;
+    if(start >= end)
+        return 0;
+    for(idx = start >> PAGE_SECTORS_SHIFT; idx <= (end - 1) >> PAGE_SECTORS_SHIFT && !err; ++idx){
+        from = max_t(sector_t, start, (sector_t)idx << PAGE_SECTORS_SHIFT);
+        to = min_t(sector_t, end, (sector_t)(idx + 1) << PAGE_SECTORS_SHIFT);
+        offset = (from & (PAGE_SECTORS - 1)) << SECTOR_SHIFT;
+        chunk = (to - from) << SECTOR_SHIFT;
+        lock = rb_image_lock(rb_dev, idx);
+        mutex_lock(lock);
+        err = rb_image_fault_locked(rb_dev, idx, chunk < PAGE_SIZE);
+        if(!err){
+            if(unmap && chunk == PAGE_SIZE)
+                err = rb_store_drop(rb_dev, idx, gfp);
+            else
+                err = rb_page_write(rb_dev, idx, NULL, offset, chunk, false, gfp);
+        }
+        if(!err)
+            rb_cache_dirty(rb_dev, idx);
+        mutex_unlock(lock);
+        cond_resched();
+    }
+    return err;
+}
+
+/* Pages fully covered by [start, end) are freed when unmap is set,
+ * partial head and tail pages are zeroed in place */
+static int rb_discard_range(struct rb_device *rb_dev, sector_t start, sector_t end, bool unmap, gfp_t gfp){
+    struct rb_layer *layer;
+    unsigned long first, last, idx;
+    void *entry;
+    int err;
+    first = DIV_ROUND_UP(start, PAGE_SECTORS);
+    last = end >> PAGE_SECTORS_SHIFT;
+    if(!unmap || first >= last)
+        return rb_zero_range(rb_dev, start, end, gfp);
+    err = rb_zero_range(rb_dev, start, (sector_t)first << PAGE_SECTORS_SHIFT, gfp);
+    if(!err)
+        err = rb_zero_range(rb_dev, (sector_t)last << PAGE_SECTORS_SHIFT, end, gfp);
+    if(err)
+        return err;
+    for(layer = rb_dev->top; layer; layer = layer->parent){
+        xa_for_each_range(&layer->pages, idx, entry, first, last - 1){
+            /* dropped or masked from the top already */
+            if(layer != rb_dev->top && xa_load(rb_dev->pages, idx))
+                continue;
+            err = rb_store_drop(rb_dev, idx, gfp);
+            if(err)
+                return err;
+        }
+    }
+    return 0;
+}
+
+/* Discard or write-zeroes, see rb_discard_range() */
+int rb_store_discard(struct rb_device *rb_dev, sector_t sector, sector_t nr_sects, bool unmap, gfp_t gfp){
+    sector_t end = sector + nr_sects;
+    int err;
+    if(rb_dev->tier_pages)
+        return rb_tier_discard(rb_dev, sector, end, unmap, gfp);
+    if(!rb_dev->image)
+        return rb_discard_range(rb_dev, sector, end, unmap, gfp);
+    err = rb_image_settle(rb_dev, sector, end);
+    if(!err)
+        err = rb_discard_range(rb_dev, sector, end, unmap, gfp);
+    /* the zeroes are owed to a cached device */
+    if(!err)
+        rb_cache_dirty_range(rb_dev, sector, end);
+    return err;
+}
@@ -0,0 +1,243 @@
+/* sysfs view of a ramdisk, under /sys/block/<disk>/ramdisk */
+#include <linux/kernel.h>
+#include <linux/device.h>
+#include <linux/sysfs.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/overflow.h>
+#include <linux/string.h>
+
+#include "IO_driver.h"
+
+static struct rb_device *dev_to_rb(struct device *dev){
+    return dev_to_disk(dev)->private_data;
+}
+
+static ssize_t numa_node_show(struct device *dev, struct device_attribute *attr, char *buf){
+    return sysfs_emit(buf, "%d\n", dev_to_rb(dev)->node);
+}
+static DEVICE_ATTR_RO(numa_node);
+
+static ssize_t numa_accesses_show(struct device *dev, struct device_attribute *attr, char *buf){
+    struct rb_stats sum;
+    rb_stats_sum(dev_to_rb(dev), &sum);
+    return sysfs_emit(buf, "local %llu\nremote %llu\n", sum.numa_local, sum.numa_remote);
+}
+static DEVICE_ATTR_RO(numa_accesses);
+
+static ssize_t same_pages_show(struct device *dev, struct device_attribute *attr, char *buf){
+    return sysfs_emit(buf, "%ld\n", atomic_long_read(&dev_to_rb(dev)->same_pages));
+}
+static DEVICE_ATTR_RO(same_pages);
+
+/* Original size of what is stored, against the memory holding it */
+static ssize_t comp_stats_show(struct device *dev, struct device_attribute *attr, char *buf){
+    struct rb_comp_stats *cs = &dev_to_rb(dev)->comp_stats;
+    long pages = atomic_long_read(&cs->pages);
+    long huge = atomic_long_read(&cs->huge);
+    return sysfs_emit(buf, "orig_bytes %lu\ncompr_bytes %lu\nincompressible %ld\nfailed %ld\n",
+                      (pages + huge) * PAGE_SIZE,
+                      atomic_long_read(&cs->bytes) + huge * PAGE_SIZE,
+                      huge, atomic_long_read(&cs->failed));
+}
+static DEVICE_ATTR_RO(comp_stats);
+
+/* Tiered store: pages in RAM against the budget, accesses served from
+ * RAM and from the image, and pages demoted so far */
+static ssize_t tier_stats_show(struct device *dev, struct device_attribute *attr, char *buf){
+    struct rb_device *rb_dev = dev_to_rb(dev);
+    struct rb_stats sum;
+    u64 total;
+    rb_stats_sum(rb_dev, &sum);
+    total = sum.tier_hits + sum.tier_misses;
+    return sysfs_emit(buf, "ram_pages %ld\nbudget_pages %lu\nhits %llu\nmisses %llu\nhit_ratio %llu\ndemoted %llu\n",
+                      atomic_long_read(&rb_dev->ram_pages), rb_dev->tier_pages,
+                      sum.tier_hits, sum.tier_misses,
+                      total ? div64_u64(sum.tier_hits * 100, total) : 100,
+                      sum.tier_demoted);
+}
+static DEVICE_ATTR_RO(tier_stats);
+
+/* Write-back cache: accesses served from RAM and read in from the lower
+ * device, pages it lacks, and pages written back in how many writes */
+static ssize_t cache_stats_show(struct device *dev, struct device_attribute *attr, char *buf){
+    struct rb_device *rb_dev = dev_to_rb(dev);
+    struct rb_stats sum;
+    u64 total;
+    rb_stats_sum(rb_dev, &sum);
+    total = sum.cache_hits + sum.cache_misses;
+    return sysfs_emit(buf, "hits %llu\nmisses %llu\nhit_ratio %llu\ndirty_pages %ld\nwritten %llu\nbatches %llu\nsyncs %llu\n",
+                      sum.cache_hits, sum.cache_misses,
+                      total ? div64_u64(sum.cache_hits * 100, total) : 100,
+                      atomic_long_read(&rb_dev->cache_dirty_pages),
+                      sum.cache_written, sum.cache_batches, sum.cache_syncs);
+}
+static DEVICE_ATTR_RO(cache_stats);
+
+/* Smallest request par_threads cuts in chunks, in KiB, 0 for none */
+static ssize_t par_copy_kb_show(struct device *dev, struct device_attribute *attr, char *buf){
+    return sysfs_emit(buf, "%u\n", READ_ONCE(dev_to_rb(dev)->par_bytes) / 1024);
+}
+
+static ssize_t par_copy_kb_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count){
+    unsigned int kb;
+    int err;
+    err = kstrtouint(buf, 0, &kb);
+    if(err)
+        return err;
+    if(kb > UINT_MAX / 1024)
+        return -ERANGE;
+    WRITE_ONCE(dev_to_rb(dev)->par_bytes, kb * 1024);
+    return count;
+}
+static DEVICE_ATTR_RW(par_copy_kb);
+
+/* Smallest transfer copied with streaming stores, in KiB, 0 for none */
+static ssize_t nt_copy_kb_show(struct device *dev, struct device_attribute *attr, char *buf){
+    return sysfs_emit(buf, "%u\n", READ_ONCE(dev_to_rb(dev)->nt_bytes) / 1024);
+}
+
+static ssize_t nt_copy_kb_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count){
+    unsigned int kb;
+    int err;
+    err = kstrtouint(buf, 0, &kb);
+    if(err)
+        return err;
+    if(kb > UINT_MAX / 1024)
+        return -ERANGE;
+    WRITE_ONCE(dev_to_rb(dev)->nt_bytes, kb * 1024);
+    return count;
+}
+static DEVICE_ATTR_RW(nt_copy_kb);
+
+static ssize_t nt_copy_kind_show(struct device *dev, struct device_attribute *attr, char *buf){
+    return sysfs_emit(buf, "%s\n", rb_copy_name());
+}
+static DEVICE_ATTR_RO(nt_copy_kind);
+
+/* Checksummed blocks: those read and checked, checked again under their
+ * lock and found corrupt, and where the last scrub pass is */
+static ssize_t integrity_stats_show(struct device *dev, struct device_attribute *attr, char *buf){
+    struct rb_device *rb_dev = dev_to_rb(dev);
+    struct rb_stats sum;
+    rb_stats_sum(rb_dev, &sum);
+    return sysfs_emit(buf, "algo %s\nverified %llu\nrechecked %llu\nerrors %llu\nscrub_running %d\nscrub_passes %u\nscrub_blocks %lu/%llu\nscrub_errors %lu\n",
+                      rb_integ_algo(), sum.integ_verified, sum.integ_rechecked, sum.integ_errors,
+                      READ_ONCE(rb_dev->scrub_running), READ_ONCE(rb_dev->scrub_passes),
+                      READ_ONCE(rb_dev->scrub_done), (unsigned long long)rb_dev->size >> (rb_dev->block_shift - SECTOR_SHIFT),
+                      READ_ONCE(rb_dev->scrub_errors));
+}
+static DEVICE_ATTR_RO(integrity_stats);
+
+/* Any write starts a scrub pass in the background */
+static ssize_t integrity_scrub_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count){
+    rb_integ_scrub(dev_to_rb(dev));
+    return count;
+}
+static DEVICE_ATTR_WO(integrity_scrub);
+
+/* Shaping knobs: a u64 field of struct rb_shape, shown and set in unit
+ * nanoseconds (1 for counts, NSEC_PER_USEC for the _us ones) */
+static ssize_t rb_shape_show(struct device *dev, char *buf, size_t off, u64 unit){
+    u64 *val = (void *)&dev_to_rb(dev)->shape + off;
+    return sysfs_emit(buf, "%llu\n", div64_u64(READ_ONCE(*val), unit));
+}
+
+static ssize_t rb_shape_store(struct device *dev, const char *buf, size_t count, size_t off, u64 unit){
+    struct rb_device *rb_dev = dev_to_rb(dev);
+    u64 *val = (void *)&rb_dev->shape + off;
+    u64 v;
+    int err;
+    err = kstrtou64(buf, 0, &v);
+    if(err)
+        return err;
+    if(check_mul_overflow(v, unit, &v))
+        return -ERANGE;
+    WRITE_ONCE(*val, v);
+    rb_shape_reset(rb_dev);
+    return count;
+}
+
+#define RB_SHAPE_ATTR(_name, _field, _unit)                                         \
+static ssize_t _name##_show(struct device *dev, struct device_attribute *attr, char *buf){ \
+    return rb_shape_show(dev, buf, offsetof(struct rb_shape, _field), _unit);   \
+}                                                                               \
+static ssize_t _name##_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count){ \
+    return rb_shape_store(dev, buf, count, offsetof(struct rb_shape, _field), _unit); \
+}                                                                               \
+static DEVICE_ATTR_RW(_name)
+
+RB_SHAPE_ATTR(shape_iops, iops, 1);
+RB_SHAPE_ATTR(shape_bps, bps, 1);
+RB_SHAPE_ATTR(shape_burst_us, burst_ns, NSEC_PER_USEC);
+RB_SHAPE_ATTR(shape_latency_us, latency_ns, NSEC_PER_USEC);
+
+static const char * const rb_lat_dist_names[] = {
+    [RB_LAT_FIXED] = "fixed",
+    [RB_LAT_UNIFORM] = "uniform",
+    [RB_LAT_EXP] = "exp",
+};
+
+static ssize_t shape_latency_dist_show(struct device *dev, struct device_attribute *attr, char *buf){
+    return sysfs_emit(buf, "%s\n", rb_lat_dist_names[READ_ONCE(dev_to_rb(dev)->shape.latency_dist)]);
+}
+
+static ssize_t shape_latency_dist_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count){
+    int dist = sysfs_match_string(rb_lat_dist_names, buf);
+    if(dist < 0)
+        return dist;
+    WRITE_ONCE(dev_to_rb(dev)->shape.latency_dist, dist);
+    return count;
+}
+static DEVICE_ATTR_RW(shape_latency_dist);
+
+static struct attribute *rb_disk_attrs[] = {
+    &dev_attr_numa_node.attr,
+    &dev_attr_numa_accesses.attr,
+    &dev_attr_same_pages.attr,
+    &dev_attr_comp_stats.attr,
+    &dev_attr_tier_stats.attr,
+    &dev_attr_cache_stats.attr,
+    &dev_attr_par_copy_kb.attr,
+    &dev_attr_nt_copy_kb.attr,
+    &dev_attr_nt_copy_kind.attr,
+    &dev_attr_integrity_stats.attr,
+    &dev_attr_integrity_scrub.attr,
+    &dev_attr_shape_iops.attr,
+    &dev_attr_shape_bps.attr,
+    &dev_attr_shape_burst_us.attr,
+    &dev_attr_shape_latency_us.attr,
+    &dev_attr_shape_latency_dist.attr,
+    NULL,
+};
+
+/* Compression, tier, cache, parallel copy and integrity attributes only show
+ * on devices using them, shaping ones on blk-mq devices */
+static umode_t rb_disk_attr_visible(struct kobject *kobj, struct attribute *attr, int n){
+    struct rb_device *rb_dev = dev_to_rb(kobj_to_dev(kobj));
+    if(attr == &dev_attr_comp_stats.attr && !rb_dev->comp)
+        return 0;
+    if(attr == &dev_attr_tier_stats.attr && !rb_dev->tier_pages)
+        return 0;
+    if(attr == &dev_attr_cache_stats.attr && !rb_dev->cache_dirty)
+        return 0;
+    if(attr == &dev_attr_par_copy_kb.attr && !rb_dev->par_threads)
+        return 0;
+    if(!strncmp(attr->name, "integrity_", 10) && !rb_dev->csums)
+        return 0;
+    if(!strncmp(attr->name, "shape_", 6) && !rb_dev->queues)
+        return 0;
+    return attr->mode;
+}
+
+static const struct attribute_group rb_disk_group = {
+    .name = "ramdisk",
+    .attrs = rb_disk_attrs,
+    .is_visible = rb_disk_attr_visible,
+};
+
+const struct attribute_group *rb_disk_groups[] = {
+    &rb_disk_group,
+    NULL,
+};
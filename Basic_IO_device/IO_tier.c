@@ -0,0 +1,146 @@
+/* tier_ram_mb: the image= file or block device becomes a lower tier. The
+ * store holds at most the RAM budget of pages; past it, a worker writes
+ * the coldest pages out to the image and frees them, and the next access
+ * reads them back in through the image fault path. Both go through the
+ * image's page cache, dropped after every batch of demotions. Coldness
+ * is a clock: every access sets the page's tier_ref bit, the hand clears
+ * it on its way and demotes the pages it finds clear. Each access holds
+ * the page's image lock, so a page is never demoted under a request
+ * using it. */
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/workqueue.h>
+#include <linux/printk.h>
+
+#include "IO_driver.h"
+
+/* Pages the hand demotes between two drops of the image's page cache */
+#define RB_TIER_BATCH 64
+
+/* Pages under budget the worker brings the store down to */
+static unsigned long rb_tier_low(struct rb_device *rb_dev){
+    return rb_dev->tier_pages - rb_dev->tier_pages / 16;
+}
+
+/* Write page idx out to the image, unless a cache knows it there, and
+ * drop it; the image lock is held */
+static int rb_tier_demote(struct rb_device *rb_dev, unsigned long idx, void *buf){
+    loff_t pos = (loff_t)idx << PAGE_SHIFT;
+    ssize_t done;
+    /* being written back by a cache_dev flush, not in the image yet */
+    if(rb_cache_busy(rb_dev, idx))
+        return 0;
+    /* freed or replaced by a fill since the hand saw it */
+    if(!rb_store_copy_page(rb_dev, idx, buf))
+        return 0;
+    /* a clean cached page is in the image already */
+    if(!rb_cache_clean(rb_dev, idx)){
+        done = kernel_write(rb_dev->image, buf, PAGE_SIZE, &pos);
+        if(done != PAGE_SIZE){
+            rb_cache_dirty(rb_dev, idx);
+            return done < 0 ? done : -EIO;
+        }
+    }
+    rb_store_evict(rb_dev, idx);
+    clear_bit(idx, rb_dev->image_loaded);
+    this_cpu_inc(rb_dev->stats->tier_demoted);
+    return 0;
+}
+
+static void rb_tier_work(struct work_struct *work){
+    struct rb_device *rb_dev = container_of(work, struct rb_device, tier_work);
+    unsigned long nr_pages = DIV_ROUND_UP(rb_dev->size, PAGE_SECTORS);
+    unsigned long idx = rb_dev->tier_hand;
+    struct mutex *lock;
+    unsigned int batch = 0;
+    bool wrapped = false;
+    void *buf;
+    int err = 0;
+    buf = kmalloc(PAGE_SIZE, GFP_KERNEL);
+    if(!buf)
+        return;
+    while(atomic_long_read(&rb_dev->ram_pages) > rb_tier_low(rb_dev) && !err){
+        if(!xa_find(rb_dev->pages, &idx, nr_pages - 1, XA_PRESENT)){
+            /* two turns without a page: the rest are fills */
+            if(wrapped)
+                break;
+            wrapped = true;
+            idx = 0;
+            continue;
+        }
+        /* second chance for pages used since the last turn */
+        if(!test_and_clear_bit(idx, rb_dev->tier_ref)){
+            lock = rb_image_lock(rb_dev, idx);
+            mutex_lock(lock);
+            err = rb_tier_demote(rb_dev, idx, buf);
+            mutex_unlock(lock);
+            /* the writes went through the page cache, which would
+             * otherwise keep what was just freed */
+            if(!err && ++batch == RB_TIER_BATCH){
+                err = rb_image_drop_cache(rb_dev);
+                batch = 0;
+            }
+        }
+        ++idx;
+        cond_resched();
+    }
+    rb_dev->tier_hand = idx;
+    kfree(buf);
+    /* the rest of the batch, and pages read in by faults since */
+    if(!err)
+        err = rb_image_drop_cache(rb_dev);
+    if(err)
+        printk(KERN_ERR "Device %d: demoting to %pD failed: %d\n",rb_dev->index, rb_dev->image, err);
+}
+
+int rb_tier_init(struct rb_device *rb_dev, unsigned long pages){
+    unsigned long nr_pages = DIV_ROUND_UP(rb_dev->size, PAGE_SECTORS);
+    rb_dev->tier_ref = kvcalloc(BITS_TO_LONGS(nr_pages), sizeof(unsigned long), GFP_KERNEL);
+    if(!rb_dev->tier_ref)
+        return -ENOMEM;
+    INIT_WORK(&rb_dev->tier_work, rb_tier_work);
+    rb_dev->tier_hand = 0;
+    rb_dev->tier_pages = pages;
+    return 0;
+}
+
+/* Before the image is closed: no demotion may run past this */
+void rb_tier_free(struct rb_device *rb_dev){
+    if(!rb_dev->tier_pages)
+        return;
+    cancel_work_sync(&rb_dev->tier_work);
+    kvfree(rb_dev->tier_ref);
+    rb_dev->tier_ref = NULL;
+    rb_dev->tier_pages = 0;
+}
+
+/* Lock page idx for an access, promoting it back from the image if it
+ * was demoted; load as for rb_image_fault() */
+int rb_tier_enter(struct rb_device *rb_dev, unsigned long idx, bool load){
+    struct mutex *lock = rb_image_lock(rb_dev, idx);
+    int err;
+    mutex_lock(lock);
+    if(test_bit(idx, rb_dev->image_loaded)){
+        this_cpu_inc(rb_dev->stats->tier_hits);
+    }else{
+        this_cpu_inc(rb_dev->stats->tier_misses);
+        err = rb_image_fault_locked(rb_dev, idx, load);
+        if(err){
+            mutex_unlock(lock);
+            return err;
+        }
+    }
+    set_bit(idx, rb_dev->tier_ref);
+    return 0;
+}
+
+/* Unlock page idx, and start demoting if the access took the store over budget */
+void rb_tier_exit(struct rb_device *rb_dev, unsigned long idx){
+    mutex_unlock(rb_image_lock(rb_dev, idx));
+    if(atomic_long_read(&rb_dev->ram_pages) > rb_dev->tier_pages)
+        queue_work(system_unbound_wq, &rb_dev->tier_work);
+}
@@ -0,0 +1,180 @@
+/* Host-managed zoned mode: the device is cut in zones of a power of 2
+ * sectors, the first ones conventional, the others written sequentially
+ * at their write pointer. A zone's lock is held over every write to it,
+ * from the write pointer check to its move, and over state changes;
+ * resetting a zone gives its pages back. */
+#include <linux/kernel.h>
+#include <linux/blkdev.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/string.h>
+#include <linux/printk.h>
+
+#include "IO_driver.h"
+
+int rb_zoned_init(struct rb_device *rb_dev, sector_t zone_sectors, unsigned int nr_conv){
+    struct rb_zone *zone;
+    unsigned int i;
+    rb_dev->zone_shift = ilog2(zone_sectors);
+    rb_dev->nr_zones = (rb_dev->size + zone_sectors - 1) >> rb_dev->zone_shift;
+    if(nr_conv >= rb_dev->nr_zones){
+        printk(KERN_ERR "Device %d: %u conventional zones out of %u leave none sequential\n",rb_dev->index, nr_conv, rb_dev->nr_zones);
+        return -EINVAL;
+    }
+    rb_dev->zones = kvcalloc(rb_dev->nr_zones, sizeof(*rb_dev->zones), GFP_KERNEL);
+    if(!rb_dev->zones)
+        return -ENOMEM;
+    for(i = 0; i < rb_dev->nr_zones; ++i){
+        zone = &rb_dev->zones[i];
+        mutex_init(&zone->lock);
+        zone->start = (sector_t)i << rb_dev->zone_shift;
+        /* the last zone may be smaller */
+        zone->len = min_t(sector_t, zone_sectors, rb_dev->size - zone->start);
+        if(i < nr_conv){
+            zone->type = BLK_ZONE_TYPE_CONVENTIONAL;
+            zone->cond = BLK_ZONE_COND_NOT_WP;
+            zone->wp = (sector_t)-1;
+        }else{
+            zone->type = BLK_ZONE_TYPE_SEQWRITE_REQ;
+            zone->cond = BLK_ZONE_COND_EMPTY;
+            zone->wp = zone->start;
+        }
+    }
+    return 0;
+}
+
+void rb_zoned_free(struct rb_device *rb_dev){
+    kvfree(rb_dev->zones);
+    rb_dev->zones = NULL;
+}
+
+static struct rb_zone *rb_zone_at(struct rb_device *rb_dev, sector_t sector){
+    return &rb_dev->zones[sector >> rb_dev->zone_shift];
+}
+
+static bool rb_zone_is_seq(struct rb_zone *zone){
+    return zone->type != BLK_ZONE_TYPE_CONVENTIONAL;
+}
+
+int rb_report_zones(struct gendisk *disk, sector_t sector, unsigned int nr_zones, report_zones_cb cb, void *data){
+    struct rb_device *rb_dev = disk->private_data;
+    unsigned int first = sector >> rb_dev->zone_shift, i;
+    struct rb_zone *zone;
+    struct blk_zone blkz;
+    int err;
+    if(first >= rb_dev->nr_zones)
+        return 0;
+    nr_zones = min(nr_zones, rb_dev->nr_zones - first);
+    for(i = 0; i < nr_zones; ++i){
+        zone = &rb_dev->zones[first + i];
+        memset(&blkz, 0, sizeof(blkz));
+        blkz.start = zone->start;
+        blkz.len = zone->len;
+        blkz.capacity = zone->len;
+        blkz.type = zone->type;
+        mutex_lock(&zone->lock);
+        blkz.wp = zone->wp;
+        blkz.cond = zone->cond;
+        mutex_unlock(&zone->lock);
+        err = cb(&blkz, first + i, data);
+        if(err)
+            return err;
+    }
+    return nr_zones;
+}
+
+/* Check a write or zone append of nr sectors against the write pointer.
+ * A sequential zone stays locked until rb_zone_write_end(); an append is
+ * moved to the write pointer, returned in *sector. */
+int rb_zone_write_begin(struct rb_device *rb_dev, enum req_op op, sector_t *sector, sector_t nr){
+    struct rb_zone *zone = rb_zone_at(rb_dev, *sector);
+    if(!rb_zone_is_seq(zone))
+        return op == REQ_OP_ZONE_APPEND ? -EIO : 0;
+    mutex_lock(&zone->lock);
+    if(zone->cond == BLK_ZONE_COND_FULL)
+        goto out_err;
+    if(op == REQ_OP_ZONE_APPEND)
+        *sector = zone->wp;
+    else if(*sector != zone->wp)
+        goto out_err;
+    if(*sector + nr > zone->start + zone->len)
+        goto out_err;
+    return 0;
+out_err:
+    mutex_unlock(&zone->lock);
+    return -EIO;
+}
+
+/* Move the write pointer over a write that went through, and unlock */
+void rb_zone_write_end(struct rb_device *rb_dev, sector_t sector, sector_t nr, bool done){
+    struct rb_zone *zone = rb_zone_at(rb_dev, sector);
+    if(!rb_zone_is_seq(zone))
+        return;
+    if(done){
+        zone->wp += nr;
+        if(zone->wp == zone->start + zone->len)
+            zone->cond = BLK_ZONE_COND_FULL;
+        else if(zone->cond == BLK_ZONE_COND_EMPTY || zone->cond == BLK_ZONE_COND_CLOSED)
+            zone->cond = BLK_ZONE_COND_IMP_OPEN;
+    }
+    mutex_unlock(&zone->lock);
+}
+
+/* Apply a zone management operation to a locked sequential zone */
+static int rb_zone_apply(struct rb_device *rb_dev, struct rb_zone *zone, enum req_op op, gfp_t gfp){
+    int err;
+    switch(op){
+    case REQ_OP_ZONE_OPEN:
+        if(zone->cond == BLK_ZONE_COND_FULL)
+            return -EIO;
+        zone->cond = BLK_ZONE_COND_EXP_OPEN;
+        return 0;
+    case REQ_OP_ZONE_CLOSE:
+        if(zone->cond == BLK_ZONE_COND_IMP_OPEN || zone->cond == BLK_ZONE_COND_EXP_OPEN)
+            zone->cond = zone->wp == zone->start ? BLK_ZONE_COND_EMPTY : BLK_ZONE_COND_CLOSED;
+        return 0;
+    case REQ_OP_ZONE_FINISH:
+        zone->wp = zone->start + zone->len;
+        zone->cond = BLK_ZONE_COND_FULL;
+        return 0;
+    case REQ_OP_ZONE_RESET:
+        if(zone->cond == BLK_ZONE_COND_EMPTY)
+            return 0;
+        /* nothing in the zone is worth keeping */
+        err = rb_integ_discard(rb_dev, zone->start, zone->len, true, gfp);
+        if(err)
+            return err;
+        zone->wp = zone->start;
+        zone->cond = BLK_ZONE_COND_EMPTY;
+        return 0;
+    default:
+        return -EOPNOTSUPP;
+    }
+}
+
+/* Zone open, close, finish and reset, of the zone at sector or of all */
+int rb_zone_mgmt(struct rb_device *rb_dev, enum req_op op, sector_t sector, gfp_t gfp){
+    struct rb_zone *zone;
+    unsigned int i;
+    int err = 0;
+    if(op == REQ_OP_ZONE_RESET_ALL){
+        for(i = 0; i < rb_dev->nr_zones && !err; ++i){
+            zone = &rb_dev->zones[i];
+            if(!rb_zone_is_seq(zone))
+                continue;
+            mutex_lock(&zone->lock);
+            err = rb_zone_apply(rb_dev, zone, REQ_OP_ZONE_RESET, gfp);
+            mutex_unlock(&zone->lock);
+        }
+        return err;
+    }
+    zone = rb_zone_at(rb_dev, sector);
+    if(!rb_zone_is_seq(zone))
+        return -EIO;
+    mutex_lock(&zone->lock);
+    err = rb_zone_apply(rb_dev, zone, op, gfp);
+    mutex_unlock(&zone->lock);
+    return err;
+}
@@ -0,0 +1,277 @@
+/* The ramdisk's copy loops, run in userspace, for machines where the
+ * module cannot be loaded. They give the CPU-side cost of a transfer
+ * only: no block layer, no fio, no completion path.
+ *
+ *   nt <stream MiB> <hot MiB> <rounds>
+ *       copies a stream with memcpy, movnti and AVX streaming stores
+ *       (IO_copy.c), each followed by a pass of a pointer chase over a
+ *       hot set; prints the copy bandwidth and the chase's ns per load,
+ *       next to the chase alone
+ *   par <MiB> <threads> <rounds>
+ *       copies a buffer whole, then in up to <threads> chunks of at
+ *       least 128 KiB on as many threads (IO_par.c); prints both rates
+ *   crc <KiB> <rounds>
+ *       copies blocks of <KiB> alone, then summed with crc32c from the
+ *       source, then summed from the copy 512 bytes at a time as
+ *       IO_integ.c does; single-stream crc32 instruction, the kernel's
+ *       library interleaves three and is faster
+ *
+ *   cc -O2 -mavx -msse4.2 -pthread -o copy_loops copy_loops.c
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <immintrin.h>
+
+#define MIB (1024 * 1024)
+#define PAR_MIN (128 * 1024)
+
+struct line {
+    struct line *next;
+    char pad[64 - sizeof(struct line *)];
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *xalloc(size_t len)
+{
+    void *p = aligned_alloc(4096, len);
+    if (!p) {
+        fprintf(stderr, "cannot allocate %zu bytes\n", len);
+        exit(1);
+    }
+    memset(p, 1, len);
+    return p;
+}
+
+/* rb_copy_movnti() */
+static void copy_movnti(void *dst, const void *src, size_t len)
+{
+    size_t head = -(uintptr_t)dst & 7;
+    uint64_t v;
+    if (head > len)
+        head = len;
+    memcpy(dst, src, head);
+    dst = (char *)dst + head;
+    src = (const char *)src + head;
+    len -= head;
+    for (; len >= 8; len -= 8, dst = (char *)dst + 8, src = (const char *)src + 8) {
+        memcpy(&v, src, 8);
+        _mm_stream_si64(dst, v);
+    }
+    memcpy(dst, src, len);
+    _mm_sfence();
+}
+
+/* rb_copy_avx(), 4 KiB per FPU section there */
+static void copy_avx(void *dst, const void *src, size_t len)
+{
+    size_t head = -(uintptr_t)dst & 31;
+    char *d = (char *)dst + head;
+    const char *s = (const char *)src + head;
+    memcpy(dst, src, head);
+    len -= head;
+    for (; len >= 128; len -= 128, d += 128, s += 128) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)s);
+        __m256i b = _mm256_loadu_si256((const __m256i *)(s + 32));
+        __m256i c = _mm256_loadu_si256((const __m256i *)(s + 64));
+        __m256i e = _mm256_loadu_si256((const __m256i *)(s + 96));
+        _mm256_stream_si256((__m256i *)d, a);
+        _mm256_stream_si256((__m256i *)(d + 32), b);
+        _mm256_stream_si256((__m256i *)(d + 64), c);
+        _mm256_stream_si256((__m256i *)(d + 96), e);
+    }
+    copy_movnti(d, s, len);
+}
+
+static struct line *hot_build(size_t mib, size_t *n)
+{
+    size_t i, j, tmp, *order;
+    struct line *lines;
+    *n = mib * MIB / sizeof(struct line);
+    lines = xalloc(*n * sizeof(struct line));
+    order = malloc(*n * sizeof(*order));
+    if (!order)
+        exit(1);
+    for (i = 0; i < *n; i++)
+        order[i] = i;
+    srand(1);
+    for (i = *n - 1; i > 0; i--) {
+        j = (size_t)rand() % (i + 1);
+        tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+    for (i = 0; i < *n; i++)
+        lines[order[i]].next = &lines[order[(i + 1) % *n]];
+    free(order);
+    return lines;
+}
+
+/* ns per load of one pass over the hot set */
+static double hot_pass(struct line *lines, size_t n)
+{
+    struct line *p = lines;
+    double start = now();
+    size_t i;
+    for (i = 0; i < n; i++)
+        p = p->next;
+    if (!p)
+        puts("");
+    return (now() - start) * 1e9 / n;
+}
+
+static int run_nt(size_t stream, size_t hot, int rounds)
+{
+    static const char *names[] = { "memcpy", "movnti", "avx" };
+    char *src = xalloc(stream * MIB), *dst = xalloc(stream * MIB);
+    double t, copy, chase;
+    struct line *lines;
+    size_t n;
+    int kind, r;
+
+    lines = hot_build(hot, &n);
+    chase = 0;
+    for (r = 0; r < rounds; r++) {
+        hot_pass(lines, n);
+        chase += hot_pass(lines, n);
+    }
+    printf("kind,copy_gbps,chase_ns_per_load\nalone,,%.2f\n", chase / rounds);
+    for (kind = 0; kind < 3; kind++) {
+        copy = chase = 0;
+        for (r = 0; r < rounds; r++) {
+            hot_pass(lines, n);
+            t = now();
+            if (kind == 0)
+                memcpy(dst, src, stream * MIB);
+            else if (kind == 1)
+                copy_movnti(dst, src, stream * MIB);
+            else
+                copy_avx(dst, src, stream * MIB);
+            copy += now() - t;
+            chase += hot_pass(lines, n);
+        }
+        printf("%s,%.2f,%.2f\n", names[kind], rounds * stream * MIB / copy / 1e9, chase / rounds);
+    }
+    return 0;
+}
+
+struct chunk {
+    char *dst;
+    const char *src;
+    size_t len;
+};
+
+static void *chunk_copy(void *arg)
+{
+    struct chunk *c = arg;
+    memcpy(c->dst, c->src, c->len);
+    return NULL;
+}
+
+static int run_par(size_t mib, int threads, int rounds)
+{
+    size_t len = mib * MIB, per, off;
+    char *src = xalloc(len), *dst = xalloc(len);
+    struct chunk chunks[64];
+    pthread_t tids[64];
+    double t, one = 0, par = 0;
+    int nr, i, r;
+
+    if (threads < 1 || threads > 64)
+        return 1;
+    /* rb_par_chunks(): page-aligned, at least PAR_MIN each */
+    nr = len / PAR_MIN < (size_t)threads ? (int)(len / PAR_MIN) : threads;
+    if (nr < 1)
+        nr = 1;
+    per = (len / nr + 4095) & ~(size_t)4095;
+    for (r = 0; r < rounds; r++) {
+        t = now();
+        memcpy(dst, src, len);
+        one += now() - t;
+        t = now();
+        for (i = 0, off = 0; i < nr; i++, off += per) {
+            chunks[i].dst = dst + off;
+            chunks[i].src = src + off;
+            chunks[i].len = off + per > len ? len - off : per;
+            pthread_create(&tids[i], NULL, chunk_copy, &chunks[i]);
+        }
+        for (i = 0; i < nr; i++)
+            pthread_join(tids[i], NULL);
+        par += now() - t;
+    }
+    printf("mib,chunks,inline_gbps,par_gbps\n%zu,%d,%.2f,%.2f\n", mib, nr,
+           rounds * len / one / 1e9, rounds * len / par / 1e9);
+    return 0;
+}
+
+static uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    uint64_t v;
+    for (; len >= 8; len -= 8, p += 8) {
+        memcpy(&v, p, 8);
+        crc = (uint32_t)_mm_crc32_u64(crc, v);
+    }
+    for (; len; len--, p++)
+        crc = _mm_crc32_u8(crc, *p);
+    return crc;
+}
+
+static int run_crc(size_t kib, int rounds)
+{
+    size_t len = kib * 1024, total = 256 * MIB, nr = total / len, i, off;
+    char *src = xalloc(total), *dst = xalloc(total), sector[512];
+    double t, plain = 0, from_src = 0, from_copy = 0;
+    volatile uint32_t sink = 0;
+    uint32_t crc;
+    int r;
+
+    for (r = 0; r < rounds; r++) {
+        t = now();
+        for (i = 0; i < nr; i++)
+            memcpy(dst + i * len, src + i * len, len);
+        plain += now() - t;
+        t = now();
+        for (i = 0; i < nr; i++) {
+            memcpy(dst + i * len, src + i * len, len);
+            sink += crc32c(~0U, src + i * len, len);
+        }
+        from_src += now() - t;
+        t = now();
+        for (i = 0; i < nr; i++) {
+            memcpy(dst + i * len, src + i * len, len);
+            crc = ~0U;
+            for (off = 0; off < len; off += 512) {
+                memcpy(sector, dst + i * len + off, 512);
+                crc = crc32c(crc, sector, 512);
+            }
+            sink += crc;
+        }
+        from_copy += now() - t;
+    }
+    printf("kib,copy_gbps,sum_source_gbps,sum_copy_gbps\n%zu,%.2f,%.2f,%.2f\n", kib,
+           rounds * (double)total / plain / 1e9, rounds * (double)total / from_src / 1e9,
+           rounds * (double)total / from_copy / 1e9);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc == 5 && !strcmp(argv[1], "nt"))
+        return run_nt(strtoul(argv[2], NULL, 0), strtoul(argv[3], NULL, 0), atoi(argv[4]));
+    if (argc == 5 && !strcmp(argv[1], "par"))
+        return run_par(strtoul(argv[2], NULL, 0), atoi(argv[3]), atoi(argv[4]));
+    if (argc == 4 && !strcmp(argv[1], "crc"))
+        return run_crc(strtoul(argv[2], NULL, 0), atoi(argv[3]));
+    fprintf(stderr, "usage: %s nt <stream MiB> <hot MiB> <rounds> | par <MiB> <threads> <rounds> | crc <KiB> <rounds>\n", argv[0]);
+    return 1;
+}
@@ -0,0 +1,98 @@
+#!/usr/bin/env python3
+"""Summarise rb_bench.sh runs and compare two of them.
+
+  fio_report.py collect <outdir>             raw/*.json -> results.{csv,json}
+  fio_report.py compare <old> <new> [pct]    rows whose IOPS, p50 or p99 moved
+                                             by more than pct percent (default 5)
+"""
+import csv
+import glob
+import json
+import os
+import sys
+
+KEY = ("label", "rw", "bs", "iodepth", "numjobs")
+FIELDS = KEY + ("read_iops", "read_bw_kib", "read_p50_us", "read_p99_us",
+                "read_p999_us", "write_iops", "write_bw_kib", "write_p50_us",
+                "write_p99_us", "write_p999_us")
+
+
+def percentile(side, pct):
+    values = side.get("clat_ns", {}).get("percentile", {})
+    return round(values.get(pct, 0) / 1000.0, 2)
+
+
+def row_from_fio(path, label):
+    with open(path) as f:
+        data = json.load(f)
+    job = data["jobs"][0]
+    opts = job["job options"]
+    row = {"label": label, "rw": opts["rw"], "bs": opts["bs"],
+           "iodepth": int(opts["iodepth"]), "numjobs": int(opts["numjobs"])}
+    for side in ("read", "write"):
+        stats = job[side]
+        row[side + "_iops"] = round(stats["iops"], 1)
+        row[side + "_bw_kib"] = stats["bw"]
+        row[side + "_p50_us"] = percentile(stats, "50.000000")
+        row[side + "_p99_us"] = percentile(stats, "99.000000")
+        row[side + "_p999_us"] = percentile(stats, "99.900000")
+    return row
+
+
+def collect(outdir):
+    with open(os.path.join(outdir, "meta.json")) as f:
+        meta = json.load(f)
+    rows = [row_from_fio(p, meta["label"])
+            for p in sorted(glob.glob(os.path.join(outdir, "raw", "*.json")))]
+    with open(os.path.join(outdir, "results.csv"), "w", newline="") as f:
+        writer = csv.DictWriter(f, fieldnames=FIELDS)
+        writer.writeheader()
+        writer.writerows(rows)
+    with open(os.path.join(outdir, "results.json"), "w") as f:
+        json.dump({"meta": meta, "results": rows}, f, indent=1)
+
+
+def load(path):
+    if os.path.isdir(path):
+        path = os.path.join(path, "results.json")
+    with open(path) as f:
+        rows = json.load(f)["results"]
+    return {tuple(r[k] for k in KEY[1:]): r for r in rows}
+
+
+def change(old, new):
+    return (new - old) * 100.0 / old if old else 0.0
+
+
+def compare(old_path, new_path, threshold):
+    old, new = load(old_path), load(new_path)
+    print("%-30s %-6s %12s %12s %8s %10s %10s %8s %10s %10s %8s" % (
+        "point", "side", "old_iops", "new_iops", "iops%", "old_p50", "new_p50",
+        "p50%", "old_p99", "new_p99", "p99%"))
+    for point in sorted(set(old) & set(new)):
+        for side in ("read", "write"):
+            a, b = old[point], new[point]
+            if not a[side + "_iops"] and not b[side + "_iops"]:
+                continue
+            d_iops = change(a[side + "_iops"], b[side + "_iops"])
+            d_p50 = change(a[side + "_p50_us"], b[side + "_p50_us"])
+            d_p99 = change(a[side + "_p99_us"], b[side + "_p99_us"])
+            if max(abs(d_iops), abs(d_p50), abs(d_p99)) < threshold:
+                continue
+            print("%-30s %-6s %12.1f %12.1f %+7.1f%% %10.2f %10.2f %+7.1f%% %10.2f %10.2f %+7.1f%%" % (
+                "%s/%s/qd%d/j%d" % point, side, a[side + "_iops"], b[side + "_iops"],
+                d_iops, a[side + "_p50_us"], b[side + "_p50_us"], d_p50,
+                a[side + "_p99_us"], b[side + "_p99_us"], d_p99))
+
+
+def main(argv):
+    if len(argv) == 3 and argv[1] == "collect":
+        collect(argv[2])
+    elif len(argv) in (4, 5) and argv[1] == "compare":
+        compare(argv[2], argv[3], float(argv[4]) if len(argv) == 5 else 5.0)
+    else:
+        sys.exit(__doc__)
+
+
+if __name__ == "__main__":
+    main(sys.argv)
@@ -0,0 +1,68 @@
+/* Cache-sensitive co-runner for rb_nt_bench.sh: chases pointers through a
+ * random cycle of cache lines spanning <MiB>, for <seconds>, and prints
+ * the number of loads per second. Sized under the LLC, its rate drops as
+ * soon as something else evicts its lines.
+ *
+ *   cc -O2 -o hotset hotset.c && ./hotset <MiB> <seconds>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+struct line {
+    struct line *next;
+    char pad[64 - sizeof(struct line *)];
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    size_t n, i, j, tmp, *order;
+    unsigned long long loads = 0;
+    struct line *lines, *p;
+    double end, start;
+    int k;
+
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <MiB> <seconds>\n", argv[0]);
+        return 1;
+    }
+    n = strtoul(argv[1], NULL, 0) * 1024 * 1024 / sizeof(struct line);
+    lines = aligned_alloc(64, n * sizeof(struct line));
+    order = malloc(n * sizeof(*order));
+    if (!n || !lines || !order) {
+        fprintf(stderr, "cannot allocate %s MiB\n", argv[1]);
+        return 1;
+    }
+    /* one cycle through every line, in random order: no prefetching */
+    for (i = 0; i < n; i++)
+        order[i] = i;
+    srand(1);
+    for (i = n - 1; i > 0; i--) {
+        j = (size_t)rand() % (i + 1);
+        tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+    for (i = 0; i < n; i++)
+        lines[order[i]].next = &lines[order[(i + 1) % n]];
+    free(order);
+
+    p = &lines[0];
+    start = now();
+    end = start + strtod(argv[2], NULL);
+    do {
+        for (k = 0; k < 65536; k++)
+            p = p->next;
+        loads += 65536;
+    } while (now() < end);
+    printf("%.0f\n", loads / (now() - start));
+    /* keep the chase from being optimised out */
+    return p == NULL;
+}
@@ -0,0 +1,116 @@
+#!/bin/sh
+# Load a block driver module and run a fio matrix against its disk.
+# Results land in <outdir>/results.csv and <outdir>/results.json, one row
+# per (rw, bs, iodepth, numjobs) point, plus the raw fio JSON per run.
+#
+# Knobs (environment): BS, QD, RW, JOBS (space separated lists), RUNTIME and
+# RAMP (seconds), IOENGINE, FIO (path to fio), HIPRI=1 for polled completions
+# (io_uring IOPOLL or pvsync2 RWF_HIPRI, the disk needs poll queues).
+set -eu
+
+usage() {
+    cat <<USAGE
+usage: $0 -d <disk> [-m <module.ko>] [-p "<module params>"] [-o <outdir>]
+          [-l <label>] [-e "<extra fio args>"] [-q]
+  -d  block device to test, e.g. /dev/my_block_device0
+  -m  module to insmod before the runs and rmmod after (default: none,
+      the disk must already exist)
+  -p  parameters passed to insmod
+  -o  output directory (default: bench_results/<date>)
+  -l  label stored with each row, to tell configurations apart
+  -e  extra arguments appended to every fio invocation
+  -q  quick matrix: 4k and 1m, QD 1 and 32, one job
+USAGE
+    exit 1
+}
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+DISK= MODULE= PARAMS= OUT= LABEL=default EXTRA= QUICK=
+while getopts d:m:p:o:l:e:qh opt; do
+    case $opt in
+    d) DISK=$OPTARG ;;
+    m) MODULE=$OPTARG ;;
+    p) PARAMS=$OPTARG ;;
+    o) OUT=$OPTARG ;;
+    l) LABEL=$OPTARG ;;
+    e) EXTRA=$OPTARG ;;
+    q) QUICK=1 ;;
+    *) usage ;;
+    esac
+done
+[ -n "$DISK" ] || usage
+
+FIO=${FIO:-fio}
+NCPU=$(nproc)
+if [ -n "$QUICK" ]; then
+    BS=${BS:-"4k 1m"}
+    QD=${QD:-"1 32"}
+    JOBS=${JOBS:-"1"}
+else
+    BS=${BS:-"512 4k 16k 64k 256k 1m"}
+    QD=${QD:-"1 8 32 128"}
+    JOBS=${JOBS:-$(j=1; l=; while [ $j -le "$NCPU" ]; do l="$l $j"; j=$((j * 2)); done; echo $l)}
+fi
+RW=${RW:-"read write randread randwrite randrw"}
+RUNTIME=${RUNTIME:-10}
+RAMP=${RAMP:-2}
+if [ -z "${IOENGINE:-}" ]; then
+    IOENGINE=libaio
+    "$FIO" --enghelp 2>/dev/null | grep -qw io_uring && IOENGINE=io_uring
+fi
+POLL=
+if [ -n "${HIPRI:-}" ]; then
+    case $IOENGINE in
+    io_uring|pvsync2) POLL=--hipri ;;
+    *) echo "HIPRI needs IOENGINE=io_uring or pvsync2" >&2; exit 1 ;;
+    esac
+fi
+OUT=${OUT:-bench_results/$(date +%Y%m%d-%H%M%S)}
+mkdir -p "$OUT/raw"
+
+command -v "$FIO" >/dev/null || { echo "fio not found" >&2; exit 1; }
+command -v python3 >/dev/null || { echo "python3 not found" >&2; exit 1; }
+
+if [ -n "$MODULE" ]; then
+    # shellcheck disable=SC2086
+    insmod "$MODULE" $PARAMS
+    trap 'rmmod "$(basename "$MODULE" .ko)"' EXIT
+    udevadm settle 2>/dev/null || sleep 1
+fi
+[ -b "$DISK" ] || { echo "$DISK is not a block device" >&2; exit 1; }
+DISK_BYTES=$(blockdev --getsize64 "$DISK")
+
+cat > "$OUT/meta.json" <<META
+{"label": "$LABEL", "disk": "$DISK", "disk_bytes": $DISK_BYTES,
+ "module": "$(basename "${MODULE:-none}")", "params": "$PARAMS",
+ "kernel": "$(uname -r)", "cpus": $NCPU, "ioengine": "$IOENGINE",
+ "runtime": $RUNTIME, "ramp": $RAMP, "extra": "$EXTRA", "hipri": "${HIPRI:-}",
+ "revision": "$(git -C "$HERE" rev-parse --short HEAD 2>/dev/null || echo unknown)",
+ "date": "$(date -Is)"}
+META
+
+for rw in $RW; do
+    for bs in $BS; do
+        bytes=$(numfmt --from=iec "$(echo "$bs" | tr a-z A-Z)")
+        if [ "$bytes" -gt "$DISK_BYTES" ]; then
+            echo "skip bs=$bs: larger than $DISK" >&2
+            continue
+        fi
+        for qd in $QD; do
+            for jobs in $JOBS; do
+                run="$rw-$bs-qd$qd-j$jobs"
+                echo "== $run"
+                # shellcheck disable=SC2086
+                "$FIO" --name="$run" --filename="$DISK" --rw="$rw" --bs="$bs" \
+                    --iodepth="$qd" --numjobs="$jobs" --ioengine="$IOENGINE" \
+                    --direct=1 --time_based --runtime="$RUNTIME" \
+                    --ramp_time="$RAMP" --group_reporting \
+                    --percentile_list=50:99:99.9 --output-format=json \
+                    --output="$OUT/raw/$run.json" $POLL $EXTRA
+            done
+        done
+    done
+done
+
+python3 "$HERE/fio_report.py" collect "$OUT"
+echo "results in $OUT/results.csv and $OUT/results.json"
@@ -0,0 +1,67 @@
+#!/bin/sh
+# backing_file= against loop with direct I/O, on the same file. The file is
+# preallocated before each run, so that neither pays for block allocation
+# the other did not. Each side runs the rb_bench.sh matrix (same knobs,
+# from the environment), then fio_report.py compares the ramdisk module
+# against loop: positive iops% means backing_file is faster.
+#
+# The file must be on a file system with direct I/O (ext4, xfs, ...). A
+# logical_block_size=N in the module parameters is also given to losetup.
+set -eu
+
+usage() {
+    cat <<USAGE
+usage: $0 -f <file> -m <module.ko> [-d <disk>] [-p "<module params>"] [-o <outdir>]
+  -f  backing file to create, e.g. /var/tmp/rb_backing.img
+  -m  module to insmod with backing_file=<file>
+  -d  disk the module creates (default: /dev/my_block_device0)
+  -p  other parameters passed to insmod, size_kb sizes the file
+  -o  output directory (default: bench_results/file-<date>)
+USAGE
+    exit 1
+}
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+FILE= MODULE= DISK=/dev/my_block_device0 PARAMS= OUT=
+while getopts f:m:d:p:o:h opt; do
+    case $opt in
+    f) FILE=$OPTARG ;;
+    m) MODULE=$OPTARG ;;
+    d) DISK=$OPTARG ;;
+    p) PARAMS=$OPTARG ;;
+    o) OUT=$OPTARG ;;
+    *) usage ;;
+    esac
+done
+[ -n "$FILE" ] && [ -n "$MODULE" ] || usage
+
+for tool in losetup fallocate python3; do
+    command -v "$tool" >/dev/null || { echo "$tool not found" >&2; exit 1; }
+done
+param() {
+    echo "$PARAMS" | tr ' ' '\n' | sed -n "s/^$1=//p" | tail -n 1
+}
+SIZE_KB=$(param size_kb)
+SIZE_KB=${SIZE_KB:-512}
+LBS=$(param logical_block_size)
+OUT=${OUT:-bench_results/file-$(date +%Y%m%d-%H%M%S)}
+
+prepare() {
+    rm -f "$FILE"
+    fallocate -l $((SIZE_KB * 1024)) "$FILE"
+}
+
+echo "== backing_file=$FILE"
+prepare
+"$HERE/rb_bench.sh" -m "$MODULE" -d "$DISK" -p "$PARAMS backing_file=$FILE" -l backing_file -o "$OUT/backing_file"
+
+echo "== losetup --direct-io=on $FILE"
+prepare
+LOOP=$(losetup --direct-io=on ${LBS:+--sector-size "$LBS"} -f --show "$FILE")
+trap 'losetup -d "$LOOP"' EXIT
+# loop falls back to buffered I/O when the file cannot take direct I/O
+[ "$(cat "/sys/block/$(basename "$LOOP")/loop/dio")" = 1 ] || echo "warning: $LOOP is not using direct I/O" >&2
+"$HERE/rb_bench.sh" -d "$LOOP" -l loop-dio -o "$OUT/loop"
+
+rm -f "$FILE"
+"$HERE/fio_report.py" compare "$OUT/loop" "$OUT/backing_file" 0
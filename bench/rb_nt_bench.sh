@@ -0,0 +1,126 @@
+#!/bin/sh
+# Cache impact of bulk ramdisk transfers on co-running work. A fio stream
+# of large blocks runs on the disk next to hotset.c, a pointer chase sized
+# to fit in the LLC, on another CPU. It runs once with plain memcpy copies
+# (nt_copy_kb=0) and once with non-temporal ones. The chase is also run
+# alone, as a baseline. For each run, <outdir>/nt.csv gets the fio
+# bandwidth, and the chase's load rate and LLC miss ratio under perf stat.
+#
+# Knobs (environment): RW (default "write read"), BS (default 1m), RUNTIME
+# (seconds), NT_KB (nt_copy_kb of the second run, default 64), HOTSET_MB
+# (default: half the LLC), FIO_CPU and HOTSET_CPU (default 1 and 0).
+set -eu
+
+usage() {
+    cat <<USAGE
+usage: $0 -d <disk> [-m <module.ko>] [-p "<module params>"] [-o <outdir>]
+  -d  ramdisk to test, e.g. /dev/my_block_device0
+  -m  module to insmod before the runs and rmmod after (default: none,
+      the disk must already exist)
+  -p  parameters passed to insmod
+  -o  output directory (default: bench_results/nt-<date>)
+USAGE
+    exit 1
+}
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+DISK= MODULE= PARAMS= OUT=
+while getopts d:m:p:o:h opt; do
+    case $opt in
+    d) DISK=$OPTARG ;;
+    m) MODULE=$OPTARG ;;
+    p) PARAMS=$OPTARG ;;
+    o) OUT=$OPTARG ;;
+    *) usage ;;
+    esac
+done
+[ -n "$DISK" ] || usage
+
+FIO=${FIO:-fio}
+RW=${RW:-"write read"}
+BS=${BS:-1m}
+RUNTIME=${RUNTIME:-10}
+NT_KB=${NT_KB:-64}
+FIO_CPU=${FIO_CPU:-1}
+HOTSET_CPU=${HOTSET_CPU:-0}
+if [ -z "${HOTSET_MB:-}" ]; then
+    llc=$(cat /sys/devices/system/cpu/cpu0/cache/index3/size 2>/dev/null || echo 8192K)
+    HOTSET_MB=$(( $(numfmt --from=iec "$llc") / 2 / 1048576 ))
+    [ "$HOTSET_MB" -gt 0 ] || HOTSET_MB=1
+fi
+OUT=${OUT:-bench_results/nt-$(date +%Y%m%d-%H%M%S)}
+mkdir -p "$OUT/raw"
+
+for tool in "$FIO" perf cc python3 taskset; do
+    command -v "$tool" >/dev/null || { echo "$tool not found" >&2; exit 1; }
+done
+cc -O2 -o "$OUT/hotset" "$HERE/hotset.c"
+
+if [ -n "$MODULE" ]; then
+    # shellcheck disable=SC2086
+    insmod "$MODULE" $PARAMS
+    trap 'rmmod "$(basename "$MODULE" .ko)"' EXIT
+    udevadm settle 2>/dev/null || sleep 1
+fi
+[ -b "$DISK" ] || { echo "$DISK is not a block device" >&2; exit 1; }
+KNOB=/sys/block/$(basename "$DISK")/ramdisk/nt_copy_kb
+[ -w "$KNOB" ] || { echo "$KNOB not found, is $DISK a ramdisk?" >&2; exit 1; }
+KIND=$(cat "$(dirname "$KNOB")/nt_copy_kind")
+[ "$KIND" != memcpy ] || echo "warning: no streaming copy on this CPU, both runs use memcpy" >&2
+
+# hotset under perf stat: prints "<loads/s>,<LLC loads>,<LLC misses>"
+hotset() {
+    taskset -c "$HOTSET_CPU" perf stat -x, -e LLC-loads,LLC-load-misses \
+        -o "$1.perf" "$OUT/hotset" "$HOTSET_MB" "$RUNTIME" > "$1.rate"
+    python3 - "$1" <<'PY'
+import sys
+base = sys.argv[1]
+rate = open(base + ".rate").read().strip()
+counts = {}
+for line in open(base + ".perf"):
+    fields = line.strip().split(",")
+    if len(fields) > 2 and fields[2].startswith("LLC-"):
+        counts[fields[2]] = fields[0]
+print("%s,%s,%s" % (rate, counts.get("LLC-loads", ""), counts.get("LLC-load-misses", "")))
+PY
+}
+
+echo "mode,rw,bs,fio_bw_kib,hotset_loads_per_s,llc_loads,llc_misses,llc_miss_pct" > "$OUT/nt.csv"
+row() {
+    python3 - "$@" >> "$OUT/nt.csv" <<'PY'
+import sys
+mode, rw, bs, bw, hot = sys.argv[1:6]
+rate, loads, misses = hot.split(",")
+try:
+    pct = "%.2f" % (100.0 * int(misses) / int(loads))
+except ValueError:
+    pct = ""
+print(",".join((mode, rw, bs, bw, rate, loads, misses, pct)))
+PY
+}
+
+echo "== hotset alone, $HOTSET_MB MiB"
+row alone - - 0 "$(hotset "$OUT/raw/alone")"
+
+for mode in plain nt; do
+    if [ "$mode" = nt ]; then echo "$NT_KB" > "$KNOB"; else echo 0 > "$KNOB"; fi
+    for rw in $RW; do
+        run="$mode-$rw-$BS"
+        echo "== $run ($KIND)"
+        taskset -c "$FIO_CPU" "$FIO" --name="$run" --filename="$DISK" \
+            --rw="$rw" --bs="$BS" --iodepth=1 --ioengine=psync --direct=1 \
+            --time_based --runtime=$((RUNTIME + 2)) --output-format=json \
+            --output="$OUT/raw/$run.json" &
+        fio_pid=$!
+        sleep 1
+        hot=$(hotset "$OUT/raw/$run")
+        wait $fio_pid
+        bw=$(python3 -c 'import json, sys; print(json.load(open(sys.argv[1]))["jobs"][0][sys.argv[2]]["bw"])' \
+            "$OUT/raw/$run.json" "$(echo "$rw" | sed 's/^rand//')")
+        row "$mode" "$rw" "$BS" "$bw" "$hot"
+    done
+done
+echo 0 > "$KNOB"
+
+column -t -s, "$OUT/nt.csv" 2>/dev/null || cat "$OUT/nt.csv"
+echo "results in $OUT/nt.csv"